@@ -0,0 +1,71 @@
+// Implementation of arena.h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+    struct arena_chunk *next; // chunk allocated before this one
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk_t;
+
+// Newest chunk first. The oldest chunk is kept across resets,
+// so a request normally doesn't call malloc at all.
+static __thread arena_chunk_t *arena = NULL;
+
+static arena_chunk_t *arena_chunk(size_t size, arena_chunk_t *next) {
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+// Allocate size bytes from the arena.
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (!arena || arena->used + size > arena->size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        arena_chunk_t *chunk = arena_chunk(chunk_size, arena);
+        if (!chunk) {
+            return NULL;
+        }
+        arena = chunk;
+    }
+    void *ptr = arena->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+// Copy at most len bytes of the given string into the arena.
+char *arena_strndup(const char *text, size_t len) {
+    size_t text_len = strnlen(text, len);
+    char *copy = arena_alloc(text_len + 1);
+    if (copy) {
+        memcpy(copy, text, text_len);
+        copy[text_len] = 0;
+    }
+    return copy;
+}
+
+// Release everything allocated from the arena.
+void arena_reset() {
+    while (arena && arena->next) {
+        arena_chunk_t *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    if (arena) {
+        arena->used = 0;
+    }
+}
@@ -0,0 +1,19 @@
+// Per-request scratch memory.
+//
+// Memory from the arena is only good until the next arena_reset(), which
+// nufs.c calls at the end of every FUSE callback, so it never has to be
+// freed. Each thread has its own arena.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Allocate size bytes from the arena.
+void *arena_alloc(size_t size);
+// Copy at most len bytes of the given string into the arena.
+char *arena_strndup(const char *text, size_t len);
+// Release everything allocated from the arena.
+void arena_reset();
+
+#endif
@@ -8,8 +8,8 @@
 #define bit_index(n) ((n) % 8)
 
 // Get the given bit from the bitmap.
-int bitmap_get(void *bm, int i) {
-    uint8_t *base = (uint8_t *) bm;
+int bitmap_get(const void *bm, int i) {
+    const uint8_t *base = (const uint8_t *) bm;
 
     return (base[byte_index(i)] >> bit_index(i)) & 1;
 }
@@ -28,8 +28,34 @@ void bitmap_put(void *bm, int i, int v) {
     }
 }
 
+// Set the given bit in the bitmap to the given value without disturbing
+// concurrent updates to the other bits in the same byte.
+void bitmap_put_atomic(void *bm, int i, int v) {
+    uint8_t *base = (uint8_t *) bm;
+
+    uint8_t bit_mask = nth_bit_mask(bit_index(i));
+
+    if (v) {
+        __atomic_fetch_or(&base[byte_index(i)], bit_mask, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_fetch_and(&base[byte_index(i)], (uint8_t) ~bit_mask, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Set the given bit in the bitmap, unless it's already set. Returns 1 if
+// this call set it, 0 if it was set before, so of several threads claiming
+// the same bit at once only one gets it.
+int bitmap_claim_atomic(void *bm, int i) {
+    uint8_t *base = (uint8_t *) bm;
+
+    uint8_t bit_mask = nth_bit_mask(bit_index(i));
+
+    uint8_t old = __atomic_fetch_or(&base[byte_index(i)], bit_mask, __ATOMIC_SEQ_CST);
+    return (old & bit_mask) == 0;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
-void bitmap_print(void *bm, int size) {
+void bitmap_print(const void *bm, int size) {
 
     for (int i = 0; i < size; i++) {
         putchar(bitmap_get(bm, i) ? '1' : '0');
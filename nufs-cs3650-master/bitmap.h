@@ -4,11 +4,15 @@
 #define BITMAP_H
 
 // Get the given bit from the bitmap.
-int bitmap_get(void* bm, int i);
+int bitmap_get(const void* bm, int i);
 // Set the given bit in the bitmap to the given value.
 // Value should be 0 or 1.
 void bitmap_put(void* bm, int i, int v);
+// Same as bitmap_put, but safe to call from several threads at once.
+void bitmap_put_atomic(void* bm, int i, int v);
+// Set the given bit if it's clear. Returns 1 if this call set it, else 0.
+int bitmap_claim_atomic(void* bm, int i);
 // Pretty-print the bitmap (with the given no. of bits).
-void bitmap_print(void* bm, int size);
+void bitmap_print(const void* bm, int size);
 
 #endif
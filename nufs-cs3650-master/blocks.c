@@ -5,15 +5,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <sys/mman.h>
+#include <stdlib.h>
+#include <sys/random.h>
 #include <sys/stat.h>
-#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "blocks_io.h"
+#include "journal.h"
 
 const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // = 4K
@@ -22,8 +26,75 @@ const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
 const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
 // Note: assumes block count is divisible by 8
 
-static int blocks_fd = -1;
-static void *blocks_base = 0;
+#define DEFAULT_STRIPE_UNIT 16 // blocks
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 2
+
+// The start of block 0, identifying the image and its format.
+// Images from before it existed have the block bitmap there instead.
+// The blocks with a fixed purpose are recorded when the image is formatted,
+// so an image laid out by another build isn't mounted with the wrong ones.
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version; // of the on-disk format, NUFS_VERSION
+    uint32_t block_count;
+    uint32_t block_size;
+    uint32_t dedup_block; // dedup index
+    uint32_t times_block; // inode timestamp table
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+} superblock_t;
+
+// The member files the blocks are striped over, in stripe order.
+// Stripe units of consecutive blocks go to the members round robin.
+static char *member_paths[MAX_MEMBERS];
+static int member_count = 0;
+static int stripe_unit = DEFAULT_STRIPE_UNIT;
+static int stripe_unit_given = 0; // named in the image spec
+
+#define MEMBER_MAGIC 0x4d53554e // "NUSM"
+#define MEMBER_VERSION 1
+
+// The first block of every member file records the layout of the image it
+// belongs to, so a member can't be mounted in the wrong place, with the
+// wrong stripe unit or together with members of another image. The
+// member's share of the blocks follows it.
+typedef struct member_header {
+    uint32_t magic;
+    uint32_t version; // MEMBER_VERSION
+    uint64_t image_id; // random, the same in all members of an image
+    uint32_t member; // position in the stripe order
+    uint32_t members;
+    uint32_t stripe_unit; // blocks
+    uint32_t block_count;
+} member_header_t;
+
+#define RESERVE_BATCH 8 // blocks a thread reserves at a time
+
+// A thread's pool of reserved blocks. Allocations are served from it without
+// taking any lock; it's refilled with a batch of free blocks from the bitmap
+// once it runs dry or the allocation wants a different group.
+//
+// Reservations live only in memory: reserved blocks stay free in the block
+// bitmap until they're handed out, so a crash can't leak them and statfs
+// counts them as free.
+typedef struct reservation {
+    int group; // group the pool was filled for
+    int next; // next slot to hand out
+    int count; // slots filled
+    int blocks[RESERVE_BATCH]; // 0 once handed out or taken back
+    struct reservation *next_pool;
+} reservation_t;
+
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+// bitmap of reserved blocks, BLOCK_BITMAP_SIZE bytes. Bits are set under
+// reserve_lock, but alloc_block_near clears them without it, so every
+// update is atomic.
+static uint8_t *reserved = NULL;
+static reservation_t *pools = NULL; // every thread's pool
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -36,64 +107,619 @@ int bytes_to_blocks(int bytes) {
     }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-    blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-    assert(blocks_fd != -1);
+// Reports a disk image that can't be used and exits.
+static void image_error(const char *image_spec, const char *msg) {
+    fprintf(stderr, "nufs: %s: %s\n", image_spec, msg);
+    exit(1);
+}
+
+// Splits the image spec "path[,path...][:stripe unit]" into member_paths.
+static void parse_image_spec(const char *image_spec) {
+    char *spec = strdup(image_spec);
+    char *unit = strrchr(spec, ':');
+    stripe_unit = DEFAULT_STRIPE_UNIT;
+    stripe_unit_given = 0;
+    if (unit && unit[1] && strspn(unit + 1, "0123456789") == strlen(unit + 1)) {
+        *unit = 0;
+        stripe_unit = atoi(unit + 1);
+        stripe_unit_given = 1;
+        if (stripe_unit <= 0 || stripe_unit > BLOCK_COUNT) {
+            image_error(image_spec, "stripe unit must be between 1 and the number of blocks");
+        }
+    }
+
+    member_count = 0;
+    char *saveptr;
+    for (char *path = strtok_r(spec, ",", &saveptr); path; path = strtok_r(NULL, ",", &saveptr)) {
+        if (member_count == MAX_MEMBERS) {
+            image_error(image_spec, "too many member files");
+        }
+        for (int i = 0; i < member_count; ++i) {
+            if (strcmp(member_paths[i], path) == 0) {
+                image_error(image_spec, "member file listed twice");
+            }
+        }
+        member_paths[member_count++] = strdup(path);
+    }
+    if (member_count == 0) {
+        image_error(image_spec, "no image file given");
+    }
+    free(spec);
+}
+
+// Reads the member headers, or writes them if the image is new, and makes
+// sure the members are the ones of one image, given in the right order.
+// A stripe unit left out of the spec is taken from the headers.
+static void check_members(const char *image_spec) {
+    member_header_t hdrs[MAX_MEMBERS];
+    int fresh = 0;
+    for (int i = 0; i < member_count; ++i) {
+        int fd = open(member_paths[i], O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            perror(member_paths[i]);
+            exit(1);
+        }
+        memset(&hdrs[i], 0, sizeof(member_header_t));
+        ssize_t got = pread(fd, &hdrs[i], sizeof(member_header_t), 0);
+        fresh += got == 0;
+        close(fd);
+    }
+
+    if (fresh == member_count) {
+        uint64_t image_id;
+        if (getrandom(&image_id, sizeof(image_id), 0) != sizeof(image_id)) {
+            image_id = (uint64_t) time(NULL) << 20 ^ getpid();
+        }
+        char block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        member_header_t *hdr = (member_header_t *) block;
+        hdr->magic = MEMBER_MAGIC;
+        hdr->version = MEMBER_VERSION;
+        hdr->image_id = image_id;
+        hdr->members = member_count;
+        hdr->stripe_unit = stripe_unit;
+        hdr->block_count = BLOCK_COUNT;
+        for (int i = 0; i < member_count; ++i) {
+            hdr->member = i;
+            int fd = open(member_paths[i], O_RDWR);
+            if (fd < 0 || pwrite(fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE || fsync(fd) < 0) {
+                perror(member_paths[i]);
+                exit(1);
+            }
+            close(fd);
+        }
+        return;
+    }
+
+    for (int i = 0; i < member_count; ++i) {
+        const member_header_t *hdr = &hdrs[i];
+        if (hdr->magic != MEMBER_MAGIC) {
+            image_error(member_paths[i], fresh ? "mixing new files with an existing image"
+                                               : "not a nufs image file");
+        } else if (hdr->version != MEMBER_VERSION || hdr->block_count != (uint32_t) BLOCK_COUNT) {
+            image_error(member_paths[i], "unsupported image layout");
+        } else if (hdr->image_id != hdrs[0].image_id) {
+            image_error(member_paths[i], "belongs to a different image");
+        } else if (hdr->members != (uint32_t) member_count) {
+            image_error(image_spec, "wrong number of member files for this image");
+        } else if (hdr->member != (uint32_t) i) {
+            image_error(member_paths[i], "member files given in the wrong order");
+        } else if (stripe_unit_given && hdr->stripe_unit != (uint32_t) stripe_unit) {
+            image_error(image_spec, "stripe unit doesn't match the one the image was made with");
+        }
+    }
+    stripe_unit = hdrs[0].stripe_unit;
+}
+
+// Number of member files.
+int blocks_members() { return member_count; }
+
+// Path of the given member file.
+const char *blocks_member_path(int member) { return member_paths[member]; }
+
+// Size of each member file in bytes, including its header block.
+off_t blocks_member_size() {
+    int stripes = (BLOCK_COUNT + stripe_unit - 1) / stripe_unit;
+    int member_stripes = (stripes + member_count - 1) / member_count;
+    return (off_t) (1 + member_stripes * stripe_unit) * BLOCK_SIZE;
+}
+
+// Find the member file and the offset in it that hold the given block.
+// The member's blocks start after its header block.
+void blocks_locate(int bnum, int *member, off_t *offset) {
+    int stripe = bnum / stripe_unit;
+    *member = stripe % member_count;
+    *offset = ((off_t) (stripe / member_count) * stripe_unit + bnum % stripe_unit + 1) * BLOCK_SIZE;
+}
+
+// Number of blocks from bnum on (at most count) in the same stripe unit.
+int blocks_run_length(int bnum, int count) {
+    int left = stripe_unit - bnum % stripe_unit;
+    return count < left ? count : left;
+}
+
+// Is the block all zeros?
+static int block_is_zero(int bnum) {
+    const uint8_t *block = blocks_peek_block(bnum);
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        if (block[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    // make sure the disk image is exactly 1MB
-    int rv = ftruncate(blocks_fd, NUFS_SIZE);
-    assert(rv == 0);
+// Does the block have a fixed purpose?
+int block_reserved(int bnum) {
+    // block 0 stores the superblock, the bitmaps and the inode table
+    return bnum == 0 ||
+           // the last block stores the dedup index
+           bnum == BLOCK_COUNT - 1 ||
+           // the one before it stores the inode timestamps
+           bnum == BLOCK_COUNT - 2 ||
+           // and the journal comes before that
+           (bnum >= JOURNAL_START && bnum < JOURNAL_START + JOURNAL_BLOCKS);
+}
 
-    // map the image to memory
-    blocks_base =
-            mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-    assert(blocks_base != MAP_FAILED);
+// Lays out an empty image: writes the superblock and marks the blocks
+// with a fixed purpose as allocated.
+static void blocks_format() {
+    superblock_t *sb = blocks_get_meta_block(0);
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->block_count = BLOCK_COUNT;
+    sb->block_size = BLOCK_SIZE;
+    sb->dedup_block = BLOCK_COUNT - 1;
+    sb->times_block = BLOCK_COUNT - 2;
+    sb->journal_start = JOURNAL_START;
+    sb->journal_blocks = JOURNAL_BLOCKS;
 
-    // block 0 stores the block bitmap and the inode bitmap
     void *bbm = get_blocks_bitmap();
-    bitmap_put(bbm, 0, 1);
+    uint8_t *refs = get_blocks_refs();
+    for (int bnum = 0; bnum < BLOCK_COUNT; ++bnum) {
+        if (block_reserved(bnum)) {
+            bitmap_put(bbm, bnum, 1);
+            refs[bnum] = 1;
+        }
+    }
+    printf("+ blocks_format() -> version %d\n", NUFS_VERSION);
+}
+
+// Exits unless block 0 holds a superblock this build can mount.
+static void check_superblock() {
+    // block 0 is in the first member
+    const char *path = member_paths[0];
+    const superblock_t *sb = blocks_peek_block(0);
+    if (sb->magic != NUFS_MAGIC) {
+        image_error(path, "not a nufs image, or made by a version too old to mount");
+    } else if (sb->version != NUFS_VERSION) {
+        image_error(path, "unsupported nufs format version");
+    } else if (sb->block_count != (uint32_t) BLOCK_COUNT ||
+               sb->block_size != (uint32_t) BLOCK_SIZE) {
+        image_error(path, "image geometry doesn't match this build");
+    } else if (sb->dedup_block != (uint32_t) BLOCK_COUNT - 1 ||
+               sb->times_block != (uint32_t) BLOCK_COUNT - 2 ||
+               sb->journal_start != (uint32_t) JOURNAL_START ||
+               sb->journal_blocks != JOURNAL_BLOCKS) {
+        image_error(path, "image layout doesn't match this build");
+    }
+}
+
+// Load and initialize the given disk image.
+// The image can be striped over several files by passing a comma separated
+// list of them, optionally followed by ":" and the stripe unit in blocks,
+// e.g. "/disk1/data.nufs,/disk2/data.nufs:32". Each file records the
+// layout, so later mounts have to list the same files in the same order,
+// and may leave the stripe unit out. Exits if the spec is malformed or
+// doesn't match the files, or if the image is laid out differently from
+// what this build expects, before the journal is replayed into it.
+void blocks_init(const char *image_path) {
+    parse_image_spec(image_path);
+    check_members(image_path);
+    blocks_io_open();
+    if (!block_is_zero(0)) {
+        check_superblock();
+    }
+    reserved = calloc(BLOCK_BITMAP_SIZE, 1);
+    assert(reserved);
+}
+
+// Delete the member files of the given disk image, so that it's created
+// from scratch the next time it's opened. Exits if the spec is malformed.
+void blocks_remove(const char *image_spec) {
+    parse_image_spec(image_spec);
+    for (int i = 0; i < member_count; ++i) {
+        if (unlink(member_paths[i]) < 0 && errno != ENOENT) {
+            perror(member_paths[i]);
+            exit(1);
+        }
+        free(member_paths[i]);
+    }
+    member_count = 0;
+}
+
+// Check the superblock, or format the image if it's new.
+// Called once the journal has been replayed, which brings back block 0 if
+// the image crashed before its first checkpoint.
+void blocks_check_format() {
+    if (block_is_zero(0)) {
+        blocks_format();
+        return;
+    }
+    check_superblock();
+    const void *bbm = peek_blocks_bitmap();
+    for (int bnum = 0; bnum < BLOCK_COUNT; ++bnum) {
+        if (block_reserved(bnum) && !bitmap_get(bbm, bnum)) {
+            image_error(member_paths[0], "a reserved block is marked free");
+        }
+    }
 }
 
 // Close the disk image.
 void blocks_free() {
-    int rv = munmap(blocks_base, NUFS_SIZE);
-    assert(rv == 0);
+    blocks_release_reservations();
+    blocks_io_close();
+    free(reserved);
+    reserved = NULL;
+    for (int i = 0; i < member_count; ++i) {
+        free(member_paths[i]);
+    }
+    member_count = 0;
+}
+
+// Write all modified blocks back to the disk image.
+void blocks_sync() {
+    blocks_io_sync();
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) { return blocks_io_get(bnum, 1); }
+
+// Get the given block for reading only.
+const void *blocks_peek_block(int bnum) { return blocks_io_get(bnum, 0); }
+
+// Get a metadata block for changing it, adding it to the journal transaction.
+void *blocks_get_meta_block(int bnum) {
+    journal_dirty(bnum);
+    return blocks_io_get(bnum, 1);
+}
+
+// Has the block been changed since it was last written back?
+int blocks_dirty(int bnum) { return blocks_io_dirty(bnum); }
+
+// Forget that the block was changed.
+void blocks_clean(int bnum) { blocks_io_clean(bnum); }
+
+// Write the given blocks back if they've changed.
+void blocks_flush(const int *bnums, int count) { blocks_io_flush(bnums, count); }
+
+// Write data to the given block's place on disk.
+void blocks_write_through(int bnum, const void *data) { blocks_io_write(bnum, data); }
+
+// Wait until everything written so far has reached the disk.
+void blocks_barrier() { blocks_io_barrier(); }
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+// The size is BLOCK_BITMAP_SIZE bytes. It follows the superblock.
+void *get_blocks_bitmap() {
+    uint8_t *block = blocks_get_meta_block(0);
+    return (void *) (block + SUPERBLOCK_SIZE);
+}
+
+// Return a pointer to the block bitmap for reading only.
+const void *peek_blocks_bitmap() {
+    const uint8_t *block = blocks_peek_block(0);
+    return block + SUPERBLOCK_SIZE;
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-    uint8_t *block = blocks_get_block(0);
-
     // The inode bitmap is stored immediately after the block bitmap
-    return (void *) (block + BLOCK_BITMAP_SIZE);
+    return (void *) ((uint8_t *) get_blocks_bitmap() + BLOCK_BITMAP_SIZE);
 }
 
-// Allocate a new block and return its index.
-int alloc_block() {
+// Return a pointer to the inode table bitmap for reading only.
+const void *peek_inode_bitmap() {
+    return (const uint8_t *) peek_blocks_bitmap() + BLOCK_BITMAP_SIZE;
+}
+
+// Return a pointer to the per-block reference counts.
+// They are stored immediately after the inode bitmap, one byte per block.
+uint8_t *get_blocks_refs() {
+    return (uint8_t *) get_inode_bitmap() + 32;
+}
+
+// Return a pointer to the per-block reference counts for reading only.
+const uint8_t *peek_blocks_refs() {
+    return (const uint8_t *) peek_inode_bitmap() + 32;
+}
+
+// Return a pointer to the per-block flags.
+// They are stored immediately after the reference counts, one byte per block.
+uint8_t *get_blocks_flags() {
+    return get_blocks_refs() + BLOCK_COUNT;
+}
+
+// Return a pointer to the per-block flags for reading only.
+const uint8_t *peek_blocks_flags() {
+    return peek_blocks_refs() + BLOCK_COUNT;
+}
+
+// Return a pointer to the dedup fingerprint index.
+void *get_dedup_index() { return blocks_get_meta_block(BLOCK_COUNT - 1); }
+
+// Return a pointer to the inode timestamp table.
+void *get_inode_times() { return blocks_get_meta_block(BLOCK_COUNT - 2); }
+
+// Return a pointer to the inode timestamp table for reading only.
+const void *peek_inode_times() { return blocks_peek_block(BLOCK_COUNT - 2); }
+
+// Return a pointer to the beginning of the inode table.
+// The inode table takes up the rest of block 0.
+void *get_inode_table() {
+    return (void *) (get_blocks_flags() + BLOCK_COUNT);
+}
+
+// Return a pointer to the inode table for reading only.
+const void *peek_inode_table() {
+    return peek_blocks_flags() + BLOCK_COUNT;
+}
+
+// Get the allocation group the given block belongs to.
+int block_group(int bnum) { return bnum / (BLOCK_COUNT / BLOCK_GROUPS); }
+
+// Get the first block of the given allocation group.
+int group_first_block(int group) { return group * (BLOCK_COUNT / BLOCK_GROUPS); }
+
+// Get the number of free blocks in the given allocation group.
+int group_free_blocks(int group) {
+    const void *bbm = peek_blocks_bitmap();
+    int free = 0;
+    for (int ii = group_first_block(group); ii < group_first_block(group + 1); ++ii) {
+        free += !bitmap_get(bbm, ii);
+    }
+    return free;
+}
+
+// Get the number of free blocks. Reserved blocks count as free.
+int free_block_count() {
+    int free = 0;
+    for (int g = 0; g < BLOCK_GROUPS; ++g) {
+        free += group_free_blocks(g);
+    }
+    return free;
+}
+
+// Returns the pool's unused blocks. Must hold reserve_lock.
+// Slots are emptied atomically, since the owner may be taking from them.
+static void pool_release(reservation_t *pool) {
+    for (int ii = 0; ii < RESERVE_BATCH; ++ii) {
+        int bnum = __atomic_exchange_n(&pool->blocks[ii], 0, __ATOMIC_SEQ_CST);
+        if (bnum) {
+            bitmap_put_atomic(reserved, bnum, 0);
+        }
+    }
+}
+
+// Returns a thread's reservations when it exits.
+static void pool_destroy(void *arg) {
+    reservation_t *pool = arg;
+    pthread_mutex_lock(&reserve_lock);
+    pool_release(pool);
+    for (reservation_t **pp = &pools; *pp; pp = &(*pp)->next_pool) {
+        if (*pp == pool) {
+            *pp = pool->next_pool;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reserve_lock);
+    free(pool);
+}
+
+static void pool_key_init() {
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+// Gets the calling thread's pool, creating it on first use.
+static reservation_t *get_pool() {
+    pthread_once(&pool_key_once, pool_key_init);
+    reservation_t *pool = pthread_getspecific(pool_key);
+    if (pool == NULL) {
+        pool = calloc(1, sizeof(reservation_t));
+        assert(pool);
+        pool->group = -1;
+        pthread_setspecific(pool_key, pool);
+        pthread_mutex_lock(&reserve_lock);
+        pool->next_pool = pools;
+        pools = pool;
+        pthread_mutex_unlock(&reserve_lock);
+    }
+    return pool;
+}
+
+// Takes the next block out of the pool, or returns 0 if it's empty.
+static int pool_take(reservation_t *pool) {
+    while (pool->next < pool->count) {
+        int bnum = __atomic_exchange_n(&pool->blocks[pool->next++], 0, __ATOMIC_SEQ_CST);
+        if (bnum) {
+            return bnum;
+        }
+    }
+    return 0;
+}
+
+// Reserves up to RESERVE_BATCH free blocks in the given group, from goal to
+// the end of the group and then from its start. Must hold reserve_lock.
+static int group_reserve(reservation_t *pool, int group, int goal) {
     void *bbm = get_blocks_bitmap();
+    int first = group_first_block(group);
+    int per_group = BLOCK_COUNT / BLOCK_GROUPS;
+    for (int ii = 0; ii < per_group && pool->count < RESERVE_BATCH; ++ii) {
+        int bnum = first + (goal - first + ii) % per_group;
+        if (!bitmap_get(bbm, bnum) && !bitmap_get(reserved, bnum)) {
+            bitmap_put_atomic(reserved, bnum, 1);
+            pool->blocks[pool->count++] = bnum;
+        }
+    }
+    return pool->count;
+}
+
+// Refills the pool with blocks as close after goal as possible, searching
+// the goal's group first and then the groups after it. If every free block
+// is reserved, the other threads' reservations are taken back first.
+static void pool_refill(reservation_t *pool, int goal) {
+    pthread_mutex_lock(&reserve_lock);
+    pool_release(pool);
+    pool->next = pool->count = 0;
+    pool->group = block_group(goal);
 
-    for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-        if (!bitmap_get(bbm, ii)) {
-            bitmap_put(bbm, ii, 1);
-            printf("+ alloc_block() -> %d\n", ii);
-            return ii;
+    for (int pass = 0; pass < 2 && pool->count == 0; ++pass) {
+        if (pass == 1) {
+            for (reservation_t *other = pools; other; other = other->next_pool) {
+                pool_release(other);
+            }
         }
+        for (int ii = 0; ii < BLOCK_GROUPS && pool->count == 0; ++ii) {
+            int g = (pool->group + ii) % BLOCK_GROUPS;
+            group_reserve(pool, g, ii == 0 ? goal : group_first_block(g));
+        }
+    }
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+// Return every thread's unused reservations.
+void blocks_release_reservations() {
+    pthread_mutex_lock(&reserve_lock);
+    for (reservation_t *pool = pools; pool; pool = pool->next_pool) {
+        pool_release(pool);
+    }
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+// Allocate a new block as close after goal as possible and return its index.
+// The goal's group is searched first, then the groups after it.
+// Blocks come out of the calling thread's reservations.
+int alloc_block_near(int goal) {
+    if (goal <= 0 || goal >= BLOCK_COUNT) {
+        goal = 1;
+    }
+
+    reservation_t *pool = get_pool();
+    int bnum = pool->group == block_group(goal) ? pool_take(pool) : 0;
+    if (bnum == 0) {
+        pool_refill(pool, goal);
+        bnum = pool_take(pool);
+    }
+    if (bnum == 0) {
+        return -1;
     }
 
-    return -1;
+    get_blocks_refs()[bnum] = 1;
+    get_blocks_flags()[bnum] = 0;
+    // mark it allocated before it stops being reserved,
+    // so no other thread can ever see it as free
+    bitmap_put_atomic(get_blocks_bitmap(), bnum, 1);
+    bitmap_put_atomic(reserved, bnum, 0);
+    printf("+ alloc_block_near(%d) -> %d\n", goal, bnum);
+    return bnum;
 }
 
-// Deallocate the block with the given index.
+// Allocate a new block and return its index.
+int alloc_block() { return alloc_block_near(1); }
+
+// Is the block free and not reserved by any thread? Must hold reserve_lock.
+static int block_available(void *bbm, int bnum) {
+    return !bitmap_get(bbm, bnum) && !bitmap_get(reserved, bnum);
+}
+
+// Allocate up to count consecutive blocks as close after goal as possible.
+// The first run of count blocks from the goal on (wrapping around to the
+// start) is taken, or else the longest run there is. The calling thread's
+// own reserved blocks are given back first, since they usually sit right
+// after its last allocation, where the goal is. Blocks reserved by other
+// threads are only taken back if nothing else is free.
+int alloc_run_near(int goal, int count, int *got) {
+    if (goal <= 0 || goal >= BLOCK_COUNT) {
+        goal = 1;
+    }
+
+    reservation_t *own = get_pool();
+    pthread_mutex_lock(&reserve_lock);
+    pool_release(own);
+    void *bbm = get_blocks_bitmap();
+    int best = -1;
+    int best_len = 0;
+    for (int pass = 0; pass < 2 && best < 0; ++pass) {
+        if (pass == 1) {
+            for (reservation_t *pool = pools; pool; pool = pool->next_pool) {
+                pool_release(pool);
+            }
+        }
+        for (int ii = 0; ii < BLOCK_COUNT - 1 && best_len < count; ++ii) {
+            int start = 1 + (goal - 1 + ii) % (BLOCK_COUNT - 1);
+            int len = 0;
+            while (start + len < BLOCK_COUNT && len < count && block_available(bbm, start + len)) {
+                len++;
+            }
+            if (len > best_len) {
+                best = start;
+                best_len = len;
+            }
+        }
+    }
+
+    uint8_t *refs = get_blocks_refs();
+    uint8_t *flags = get_blocks_flags();
+    for (int bnum = best; bnum >= 0 && bnum < best + best_len; ++bnum) {
+        refs[bnum] = 1;
+        flags[bnum] = 0;
+        bitmap_put_atomic(bbm, bnum, 1);
+    }
+    pthread_mutex_unlock(&reserve_lock);
+
+    *got = best_len;
+    printf("+ alloc_run_near(%d, %d) -> %d, %d blocks\n", goal, count, best, best_len);
+    return best;
+}
+
+// Is the block preallocated and not written yet?
+int block_unwritten(int bnum) {
+    return (peek_blocks_flags()[bnum] & BLOCK_UNWRITTEN) != 0;
+}
+
+// Drop a reference to the block with the given index.
+// The block is only deallocated once its last reference is gone.
 void free_block(int bnum) {
+    uint8_t *refs = get_blocks_refs();
+    uint8_t old = __atomic_fetch_sub(&refs[bnum], 1, __ATOMIC_SEQ_CST);
+    if (old > 1) {
+        printf("+ free_block(%d) -> %d refs\n", bnum, old - 1);
+        return;
+    }
+
     printf("+ free_block(%d)\n", bnum);
     void *bbm = get_blocks_bitmap();
-    bitmap_put(bbm, bnum, 0);
+    refs[bnum] = 0;
+    get_blocks_flags()[bnum] = 0;
+    journal_forget(bnum);
+    bitmap_put_atomic(bbm, bnum, 0);
+}
+
+// Add a reference to the block with the given index.
+int ref_block(int bnum) {
+    uint8_t *refs = get_blocks_refs();
+    uint8_t old = __atomic_load_n(&refs[bnum], __ATOMIC_SEQ_CST);
+    do {
+        if (old == UINT8_MAX) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&refs[bnum], &old, old + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    printf("+ ref_block(%d) -> %d refs\n", bnum, old + 1);
+    return 0;
+}
+
+// Get the number of references to the block with the given index.
+int block_refcount(int bnum) {
+    return peek_blocks_refs()[bnum];
 }
\ No newline at end of file
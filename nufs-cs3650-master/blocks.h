@@ -3,6 +3,7 @@
 #ifndef PAGES_H
 #define PAGES_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
@@ -11,28 +12,147 @@ const int NUFS_SIZE;   // default = 1MB
 
 const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
 
+// Block 0 starts with the superblock, which identifies the image format.
+// The bitmaps, reference counts, flags and inode table follow it.
+#define SUPERBLOCK_SIZE 64 // bytes
+
+// The blocks are divided into allocation groups of BLOCK_COUNT / BLOCK_GROUPS
+// consecutive blocks. Each group has its own slice of the block bitmap and of
+// the inode table, so related inodes and data can be kept close together.
+#define BLOCK_GROUPS 4
+
+// Per-block flags, see get_blocks_flags()
+#define BLOCK_PACKED 0x1 // first block of a compressed cluster
+#define BLOCK_DEDUP 0x2 // in the dedup index, may be shared by identical pages
+#define BLOCK_UNWRITTEN 0x4 // preallocated, reads as zeros until it's written
+
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes);
 
-// Load and initialize the given disk image.
+// Open the given disk image. Exits if the files don't make up an image.
 void blocks_init(const char* path);
 
+// Check the image's superblock once the journal is replayed, formatting
+// the image if it's new. Exits if it isn't a nufs image this version can
+// mount, or if the blocks with a fixed purpose aren't allocated.
+void blocks_check_format();
+
+// Does the block have a fixed purpose: the superblock, the journal, the
+// timestamp table or the dedup index? Files can never use these.
+int block_reserved(int pnum);
+
+// Delete the member files of the given disk image, see blocks_init for the
+// spec. Exits if the spec is malformed.
+void blocks_remove(const char* image_spec);
+
 // Close the disk image.
 void blocks_free();
 
+// Write all modified blocks back to the disk image.
+// This bypasses the journal, use journal_sync instead while mounted.
+void blocks_sync();
+
 // Get the block with the given index, returning a pointer to its start.
 void* blocks_get_block(int pnum);
 
+// Get a block holding metadata for changing it. The block becomes part of
+// the running journal transaction, see journal.h.
+void* blocks_get_meta_block(int pnum);
+
+// Get the block with the given index for reading only. Backends that track
+// modified blocks don't write it back, so don't write through the pointer.
+const void* blocks_peek_block(int pnum);
+
+// Has the block been changed since it was last written back?
+int blocks_dirty(int pnum);
+
+// Forget that the block was changed, so only the journal writes it back.
+void blocks_clean(int pnum);
+
+// Write the given blocks back if they've changed,
+// without waiting for them to reach the disk.
+void blocks_flush(const int* pnums, int count);
+
+// Write data to the given block's place on disk, leaving the block itself
+// alone. Doesn't wait for it to reach the disk either.
+void blocks_write_through(int pnum, const void* data);
+
+// Wait until everything written so far has reached the disk.
+void blocks_barrier();
+
+// The get_ functions below are for changing block 0 and add it to the
+// journal transaction, the peek_ ones are for reading it only.
+
 // Return a pointer to the beginning of the block bitmap.
 void* get_blocks_bitmap();
+const void* peek_blocks_bitmap();
 
 // Return a pointer to the beginning of the inode_t table bitmap.
 void* get_inode_bitmap();
+const void* peek_inode_bitmap();
+
+// Return a pointer to the per-block reference counts (BLOCK_COUNT bytes).
+uint8_t* get_blocks_refs();
+const uint8_t* peek_blocks_refs();
+
+// Return a pointer to the per-block flags (BLOCK_COUNT bytes).
+uint8_t* get_blocks_flags();
+const uint8_t* peek_blocks_flags();
+
+// Return a pointer to the dedup fingerprint index (the last block).
+void* get_dedup_index();
+
+// Return a pointer to the inode timestamp table (the second to last block).
+void* get_inode_times();
+const void* peek_inode_times();
+
+// Return a pointer to the beginning of the inode_t table.
+void* get_inode_table();
+const void* peek_inode_table();
 
 // Allocate a new block and return its index.
 int alloc_block();
 
-// Deallocate the block with the given index.
+// Allocate a new block as close after the goal block as possible,
+// preferring the goal's allocation group, and return its index.
+// Safe to call from several threads at once.
+int alloc_block_near(int goal);
+
+// Allocate up to count consecutive blocks, starting as close after the goal
+// block as possible, and return the first of them. *got is set to the number
+// of blocks in the run, which is less than count if there's no free run that
+// long. Returns -1 if no block is free. Safe to call from several threads.
+int alloc_run_near(int goal, int count, int* got);
+
+// Is the block preallocated and not written yet? See BLOCK_UNWRITTEN.
+int block_unwritten(int pnum);
+
+// Get the allocation group the given block belongs to.
+int block_group(int pnum);
+
+// Get the first block of the given allocation group.
+int group_first_block(int group);
+
+// Get the number of free blocks in the given allocation group.
+int group_free_blocks(int group);
+
+// Get the number of free blocks in the image.
+int free_block_count();
+
+// Blocks are handed out from per-thread reservations, see alloc_block_near.
+// Return every thread's unused reservations to the free space.
+void blocks_release_reservations();
+
+// Drop a reference to the block with the given index, deallocating it
+// once nobody refers to it anymore. Safe to call from several threads.
 void free_block(int pnum);
 
+// Add a reference to the block with the given index so it can be shared.
+// Returns -1 if the reference count is saturated. Safe to call from
+// several threads.
+int ref_block(int pnum);
+
+// Get the number of references to the block with the given index.
+int block_refcount(int pnum);
+
 #endif
@@ -0,0 +1,58 @@
+// Backends that hold the disk image for blocks.c.
+//
+// Exactly one backend is compiled in: blocks_mmap.c by default, or
+// blocks_uring.c when built with NUFS_IO_URING (make BACKEND=uring).
+
+#ifndef BLOCKS_IO_H
+#define BLOCKS_IO_H
+
+#include <sys/types.h>
+
+// The disk image can be striped over several member files, see blocks_init.
+// These are provided by blocks.c for the backends.
+
+#define MAX_MEMBERS 16
+
+// Number of member files.
+int blocks_members();
+// Path of the given member file.
+const char *blocks_member_path(int member);
+// Size of each member file in bytes. Each starts with a header block
+// written and checked by blocks.c, which the backends leave alone.
+off_t blocks_member_size();
+// Find the member file and the offset in it that hold the given block.
+void blocks_locate(int bnum, int *member, off_t *offset);
+// Number of blocks from bnum on (at most count) that are stored next to
+// each other in the same member file.
+int blocks_run_length(int bnum, int count);
+
+// Open the member files of the disk image, creating them if needed.
+void blocks_io_open();
+
+// Write everything back and close the disk image.
+void blocks_io_close();
+
+// Get the given block. write is zero if the caller only reads it.
+void *blocks_io_get(int bnum, int write);
+
+// Has the block been handed out for writing since it was last written back?
+int blocks_io_dirty(int bnum);
+
+// Mark the block as not needing to be written back.
+void blocks_io_clean(int bnum);
+
+// Write those of the given blocks that are dirty back to the disk image,
+// without waiting for them to reach the disk.
+void blocks_io_flush(const int *bnums, int count);
+
+// Write data to the given block's place in the disk image, leaving the
+// in-memory block alone. Doesn't wait for it to reach the disk.
+void blocks_io_write(int bnum, const void *data);
+
+// Wait until everything written to the member files is on disk.
+void blocks_io_barrier();
+
+// Write all modified blocks back to the disk image and wait for them.
+void blocks_io_sync();
+
+#endif
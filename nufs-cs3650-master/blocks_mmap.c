@@ -0,0 +1,141 @@
+// mmap backend for blocks.c, see blocks_io.h
+//
+// Each member file is mapped MAP_PRIVATE, so changes to blocks stay in
+// memory until they're written back with pwrite. With a shared mapping the
+// kernel could write metadata back before its journal record, whenever it
+// liked. Blocks handed out for writing are marked dirty, and flushes only
+// write the dirty ones they're asked for, as runs of consecutive blocks.
+
+#ifndef NUFS_IO_URING
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "blocks_io.h"
+
+
+static int blocks_fds[MAX_MEMBERS];
+static char *blocks_bases[MAX_MEMBERS];
+static uint8_t *dirty = NULL; // bitmap of blocks handed out for writing
+
+// Open and map the member files.
+void blocks_io_open() {
+    off_t size = blocks_member_size();
+    for (int i = 0; i < blocks_members(); ++i) {
+        blocks_fds[i] = open(blocks_member_path(i), O_CREAT | O_RDWR, 0644);
+        assert(blocks_fds[i] != -1);
+
+        // make sure the member holds exactly its share of the image
+        int rv = ftruncate(blocks_fds[i], size);
+        assert(rv == 0);
+
+        // map the member to memory
+        blocks_bases[i] =
+                mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, blocks_fds[i], 0);
+        assert(blocks_bases[i] != MAP_FAILED);
+    }
+    dirty = calloc(BLOCK_BITMAP_SIZE, 1);
+    assert(dirty);
+}
+
+// Write everything back, then unmap and close the member files.
+void blocks_io_close() {
+    blocks_io_sync();
+    for (int i = 0; i < blocks_members(); ++i) {
+        int rv = munmap(blocks_bases[i], blocks_member_size());
+        assert(rv == 0);
+        close(blocks_fds[i]);
+    }
+    free(dirty);
+}
+
+// Get the given block, returning a pointer to its start.
+void *blocks_io_get(int bnum, int write) {
+    int member;
+    off_t offset;
+    blocks_locate(bnum, &member, &offset);
+    if (write) {
+        bitmap_put_atomic(dirty, bnum, 1);
+    }
+    return blocks_bases[member] + offset;
+}
+
+// Has the block been handed out for writing since it was last written back?
+int blocks_io_dirty(int bnum) { return bitmap_get(dirty, bnum); }
+
+// Mark the block as not needing to be written back.
+void blocks_io_clean(int bnum) { bitmap_put_atomic(dirty, bnum, 0); }
+
+// Writes count bytes to the given offset of a member file.
+static void member_write(int member, const void *data, size_t count, off_t offset) {
+    while (count > 0) {
+        ssize_t rv = pwrite(blocks_fds[member], data, count, offset);
+        assert(rv > 0);
+        data = (const char *) data + rv;
+        count -= rv;
+        offset += rv;
+    }
+}
+
+// Write those of the given blocks that are dirty back to their member files.
+// Consecutive blocks in the same stripe unit go out in one write.
+void blocks_io_flush(const int *bnums, int count) {
+    int i = 0;
+    while (i < count) {
+        int start = bnums[i];
+        if (!bitmap_get(dirty, start)) {
+            i++;
+            continue;
+        }
+        int run = 0;
+        while (i + run < count && bnums[i + run] == start + run &&
+               blocks_run_length(start, run + 1) == run + 1 &&
+               bitmap_get(dirty, start + run)) {
+            // cleared first, so a change made while it's written is kept
+            bitmap_put_atomic(dirty, start + run, 0);
+            run++;
+        }
+
+        int member;
+        off_t offset;
+        blocks_locate(start, &member, &offset);
+        member_write(member, blocks_bases[member] + offset, (size_t) run * BLOCK_SIZE, offset);
+        i += run;
+    }
+}
+
+// Write data to the given block's place in its member file.
+void blocks_io_write(int bnum, const void *data) {
+    int member;
+    off_t offset;
+    blocks_locate(bnum, &member, &offset);
+    member_write(member, data, BLOCK_SIZE, offset);
+}
+
+// Wait until everything written to the member files is on disk.
+void blocks_io_barrier() {
+    for (int i = 0; i < blocks_members(); ++i) {
+        int rv = fdatasync(blocks_fds[i]);
+        assert(rv == 0);
+    }
+}
+
+// Write all dirty blocks back and wait for them.
+void blocks_io_sync() {
+    int bnums[BLOCK_COUNT];
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        bnums[i] = i;
+    }
+    blocks_io_flush(bnums, BLOCK_COUNT);
+    blocks_io_barrier();
+}
+
+#endif
@@ -0,0 +1,401 @@
+// io_uring backend for blocks.c, see blocks_io.h
+//
+// The image is kept in an in-memory copy. Reads for the whole image are
+// submitted when it's opened and complete in the background while requests
+// are handled; a block that's needed before its read has completed is waited
+// for. Blocks handed out for writing are marked dirty and only written back
+// when they're flushed, as vectored writes of runs of consecutive dirty
+// blocks; blocks_io_sync also queues an fsync of every member file after
+// them, all in one submission. Runs are split at stripe unit boundaries,
+// so a striped image keeps all of its member devices busy at once.
+// The ring is shared by all threads, under ring_lock.
+//
+// Talks to the kernel with the raw system calls, so it doesn't need liburing.
+
+#ifdef NUFS_IO_URING
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// linux/fs.h (via linux/io_uring.h) has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "blocks_io.h"
+
+#define RING_ENTRIES 64
+#define READAHEAD_RUN 16 // blocks per read request
+#define WRITE_RUN 16 // max blocks per write request
+
+// What a request was for, packed into its user_data with the blocks it covers.
+#define OP_READ 1
+#define OP_WRITE 2
+#define OP_FSYNC 3
+
+
+#define ring_data(op, start, count) (((uint64_t) (op) << 48) | ((uint64_t) (count) << 32) | (start))
+#define ring_data_op(data) ((int) ((data) >> 48))
+#define ring_data_count(data) ((int) (((data) >> 32) & 0xffff))
+#define ring_data_start(data) ((int) ((data) & 0xffffffff))
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned pending; // queued, not submitted yet
+    unsigned inflight; // submitted, not completed yet
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+static uring_t ring;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int blocks_fds[MAX_MEMBERS];
+static char *blocks_cache = NULL;
+static struct iovec *blocks_iov = NULL; // one per block, pointing into the cache
+static uint8_t *resident = NULL; // bitmap of blocks that have been read in
+static uint8_t *dirty = NULL; // bitmap of blocks handed out for writing
+
+static int uring_setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0) {
+        return -1;
+    }
+
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size) {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(0, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(0, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(0, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    char *sq = ring.sq_ring;
+    char *cq = ring.cq_ring;
+    ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring.sq_entries = p.sq_entries;
+    ring.pending = 0;
+    ring.inflight = 0;
+    return 0;
+}
+
+static void uring_teardown() {
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+}
+
+// Handles a finished request. Short or failed transfers are redone
+// synchronously so callers never see them.
+static void uring_complete(uint64_t data, int res) {
+    int op = ring_data_op(data);
+    int start = ring_data_start(data);
+    int count = ring_data_count(data);
+    int member;
+    off_t offset;
+    blocks_locate(start, &member, &offset);
+
+    if (op == OP_READ) {
+        if (res != count * BLOCK_SIZE) {
+            ssize_t rv = preadv(blocks_fds[member], &blocks_iov[start], count, offset);
+            assert(rv == count * BLOCK_SIZE);
+        }
+        for (int i = start; i < start + count; ++i) {
+            bitmap_put(resident, i, 1);
+        }
+    } else if (op == OP_WRITE) {
+        if (res != count * BLOCK_SIZE) {
+            ssize_t rv = pwritev(blocks_fds[member], &blocks_iov[start], count, offset);
+            assert(rv == count * BLOCK_SIZE);
+        }
+    } else if (op == OP_FSYNC && res < 0) {
+        // the member is passed as the start block
+        int rv = fsync(blocks_fds[start]);
+        assert(rv == 0);
+    }
+}
+
+// Handles all the requests that have finished.
+static void uring_reap() {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        uring_complete(cqe->user_data, cqe->res);
+        ring.inflight--;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits the queued requests and waits for at least wait_nr to finish.
+static void uring_enter(unsigned wait_nr) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int rv = syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait_nr, flags, NULL, 0);
+        if (rv >= 0) {
+            ring.pending -= rv;
+            ring.inflight += rv;
+            break;
+        }
+        assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        uring_reap();
+    }
+    uring_reap();
+}
+
+// Gets a free submission slot, making room if the ring is full.
+static struct io_uring_sqe *uring_sqe() {
+    while (ring.pending + ring.inflight >= RING_ENTRIES) {
+        uring_enter(1);
+    }
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+// Makes the slot from uring_sqe visible to the kernel.
+static void uring_queue() {
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+}
+
+// Queues a read or write of count consecutive blocks,
+// one request per member file they're stored in.
+static void uring_queue_rw(int op, int start, int count) {
+    while (count > 0) {
+        int run = blocks_run_length(start, count);
+        int member;
+        off_t offset;
+        blocks_locate(start, &member, &offset);
+
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = op == OP_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = blocks_fds[member];
+        sqe->addr = (uint64_t) (uintptr_t) &blocks_iov[start];
+        sqe->len = run;
+        sqe->off = offset;
+        sqe->user_data = ring_data(op, start, run);
+        uring_queue();
+
+        start += run;
+        count -= run;
+    }
+}
+
+// Open the member files and start reading all of the image in.
+void blocks_io_open() {
+    int rv;
+    for (int i = 0; i < blocks_members(); ++i) {
+        blocks_fds[i] = open(blocks_member_path(i), O_CREAT | O_RDWR, 0644);
+        assert(blocks_fds[i] != -1);
+
+        // make sure the member holds exactly its share of the image
+        rv = ftruncate(blocks_fds[i], blocks_member_size());
+        assert(rv == 0);
+    }
+
+    blocks_cache = aligned_alloc(BLOCK_SIZE, NUFS_SIZE);
+    blocks_iov = malloc(BLOCK_COUNT * sizeof(struct iovec));
+    resident = calloc(BLOCK_BITMAP_SIZE, 1);
+    dirty = calloc(BLOCK_BITMAP_SIZE, 1);
+    assert(blocks_cache && blocks_iov && resident && dirty);
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        blocks_iov[i].iov_base = blocks_cache + BLOCK_SIZE * i;
+        blocks_iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    rv = uring_setup(RING_ENTRIES);
+    assert(rv == 0);
+
+    for (int start = 0; start < BLOCK_COUNT; start += READAHEAD_RUN) {
+        int count = BLOCK_COUNT - start < READAHEAD_RUN ? BLOCK_COUNT - start : READAHEAD_RUN;
+        uring_queue_rw(OP_READ, start, count);
+    }
+    uring_enter(0);
+}
+
+// Write everything back and close the disk image.
+void blocks_io_close() {
+    blocks_io_sync();
+    uring_teardown();
+    for (int i = 0; i < blocks_members(); ++i) {
+        close(blocks_fds[i]);
+    }
+    free(blocks_cache);
+    free(blocks_iov);
+    free(resident);
+    free(dirty);
+}
+
+// Get the given block, waiting for it to be read in if it hasn't been yet.
+void *blocks_io_get(int bnum, int write) {
+    if (!bitmap_get(resident, bnum)) {
+        pthread_mutex_lock(&ring_lock);
+        while (!bitmap_get(resident, bnum)) {
+            uring_enter(1);
+        }
+        pthread_mutex_unlock(&ring_lock);
+    }
+    if (write) {
+        bitmap_put_atomic(dirty, bnum, 1);
+    }
+    return blocks_cache + BLOCK_SIZE * bnum;
+}
+
+// Has the block been handed out for writing since it was last written back?
+int blocks_io_dirty(int bnum) { return bitmap_get(dirty, bnum); }
+
+// Mark the block as not needing to be written back.
+void blocks_io_clean(int bnum) { bitmap_put_atomic(dirty, bnum, 0); }
+
+// Queues vectored writes of the dirty blocks among the given ones,
+// in runs of consecutive blocks. Returns the number of runs.
+static int uring_queue_dirty(const int *bnums, int count) {
+    int writes = 0;
+    int i = 0;
+    while (i < count) {
+        int start = bnums[i];
+        if (!bitmap_get(dirty, start)) {
+            i++;
+            continue;
+        }
+        int run = 0;
+        while (i + run < count && run < WRITE_RUN && bnums[i + run] == start + run &&
+               bitmap_get(dirty, start + run)) {
+            bitmap_put_atomic(dirty, start + run, 0);
+            run++;
+        }
+        uring_queue_rw(OP_WRITE, start, run);
+        writes++;
+        i += run;
+    }
+    return writes;
+}
+
+// Queues an fsync of every member, to run after everything before it.
+static void uring_queue_fsyncs() {
+    for (int i = 0; i < blocks_members(); ++i) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->fd = blocks_fds[i];
+        sqe->user_data = ring_data(OP_FSYNC, i, 0);
+        uring_queue();
+    }
+}
+
+// Submits everything queued and waits for all of it to finish.
+static void uring_drain() {
+    uring_enter(0);
+    while (ring.inflight > 0 || ring.pending > 0) {
+        uring_enter(1);
+    }
+}
+
+// Write the dirty blocks among the given ones back and wait for the writes.
+void blocks_io_flush(const int *bnums, int count) {
+    pthread_mutex_lock(&ring_lock);
+    if (uring_queue_dirty(bnums, count) > 0) {
+        uring_drain();
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+// Write data to the given block's place in its member file. Only used for
+// the journal, a block at a time, so it's written synchronously.
+void blocks_io_write(int bnum, const void *data) {
+    int member;
+    off_t offset;
+    blocks_locate(bnum, &member, &offset);
+    ssize_t rv = pwrite(blocks_fds[member], data, BLOCK_SIZE, offset);
+    assert(rv == BLOCK_SIZE);
+}
+
+// Wait until everything written to the member files is on disk.
+void blocks_io_barrier() {
+    pthread_mutex_lock(&ring_lock);
+    uring_queue_fsyncs();
+    uring_drain();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+// Write all dirty blocks back with one batch of vectored writes
+// and fsyncs of the members that run after them.
+void blocks_io_sync() {
+    int bnums[BLOCK_COUNT];
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        bnums[i] = i;
+    }
+    pthread_mutex_lock(&ring_lock);
+    int writes = uring_queue_dirty(bnums, BLOCK_COUNT);
+    if (writes > 0) {
+        uring_queue_fsyncs();
+        uring_drain();
+        printf("+ blocks_io_sync() -> %d writes\n", writes);
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+#endif
@@ -0,0 +1,480 @@
+// Implementation of compress.h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "compress.h"
+
+// Stored at the start of the first block of a compressed cluster.
+typedef struct cluster_header {
+    uint8_t codec;  // codec id
+    uint8_t blocks; // number of blocks used, including this one
+    uint16_t unused;
+    int size;       // compressed bytes following the header
+    int raw_size;   // bytes of file data in the cluster
+} cluster_header_t;
+
+#define CACHE_SLOTS 16
+
+// A decompressed cluster
+typedef struct cluster_cache_entry {
+    int used;
+    int inum;
+    int cluster;
+    unsigned long last_use;
+    char data[CLUSTER_SIZE];
+} cluster_cache_entry_t;
+
+static cluster_cache_entry_t cluster_cache[CACHE_SLOTS];
+static unsigned long cache_clock = 0;
+// FUSE runs callbacks on several threads; this guards the cache and clock.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// "lz" codec: byte oriented LZ77 in the style of LZ4. Every sequence is a
+// token (4 bits literal length, 4 bits match length), the literals, and a
+// 2 byte match offset. The last sequence has no match.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static int lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that didn't fit in the token.
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *oend, int len) {
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Reads the rest of a length that didn't fit in the token.
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, int len) {
+    if (len != 15) {
+        return len;
+    }
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// Writes lit_len literals followed by a match (none if match_len is 0).
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                                int lit_len, int offset, int match_len) {
+    if (op >= oend) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15))) {
+        return NULL;
+    }
+    if (op + lit_len > oend) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+    if (op + 2 > oend) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    int extra = match_len - LZ_MIN_MATCH;
+    *token |= extra < 15 ? extra : 15;
+    if (extra >= 15 && !(op = lz_put_length(op, oend, extra - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+static int lz_compress(const char *src, int src_len, char *dst, int dst_cap) {
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + src_len;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + dst_cap;
+
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= iend) {
+        int h = lz_hash(ip);
+        int ref = table[h];
+        table[h] = ip - base;
+        if (ref < 0 || ip - (base + ref) > LZ_MAX_OFFSET ||
+            memcmp(base + ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        const uint8_t *match = base + ref;
+        int len = LZ_MIN_MATCH;
+        while (ip + len < iend && match[len] == ip[len]) {
+            len++;
+        }
+        op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - match, len);
+        if (!op) {
+            return -1;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (!op) {
+        return -1;
+    }
+    return op - (uint8_t *) dst;
+}
+
+static int lz_decompress(const char *src, int src_len, char *dst, int dst_cap) {
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + dst_cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit_len = lz_get_length(&ip, iend, token >> 4);
+        if (lit_len < 0 || ip + lit_len > iend || op + lit_len > oend) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (ip + 2 > iend) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int match_len = lz_get_length(&ip, iend, token & 15);
+        if (match_len < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - (uint8_t *) dst || op + match_len > oend) {
+            return -1;
+        }
+        // the match may overlap what it's producing, so copy byte by byte
+        const uint8_t *match = op - offset;
+        for (int i = 0; i < match_len; ++i) {
+            *op++ = *match++;
+        }
+    }
+    return op - (uint8_t *) dst;
+}
+
+// Codecs are identified on disk by their index in this table,
+// so new ones have to be added at the end.
+static const codec_t codecs[] = {
+    {"lz", lz_compress, lz_decompress},
+};
+
+#define CODEC_COUNT ((int) (sizeof(codecs) / sizeof(codecs[0])))
+
+// Get the id of the codec with the given name, or -1 if there is none.
+int compress_codec_id(const char *name) {
+    for (int i = 0; i < CODEC_COUNT; ++i) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Get the codec with the given id, or NULL if there is none.
+const codec_t *compress_codec(int id) {
+    if (id < 0 || id >= CODEC_COUNT) {
+        return NULL;
+    }
+    return &codecs[id];
+}
+
+// Byte offset of the given page of a cluster, as used by inode_get_pnum.
+static int cluster_page(int cluster, int i) {
+    return (cluster * CLUSTER_PAGES + i) * 4096;
+}
+
+// Number of pages the cluster has at the file's current size.
+static int cluster_pages(const inode_t *node, int cluster) {
+    int pages = node->size / 4096 + 1 - cluster * CLUSTER_PAGES;
+    if (pages < 0) {
+        return 0;
+    }
+    return pages < CLUSTER_PAGES ? pages : CLUSTER_PAGES;
+}
+
+// Is the cluster stored compressed?
+static int cluster_is_packed(const inode_t *node, int cluster) {
+    if (cluster_pages(node, cluster) == 0) {
+        return 0;
+    }
+    int pnum = inode_get_pnum(node, cluster_page(cluster, 0));
+    return pnum && (peek_blocks_flags()[pnum] & BLOCK_PACKED);
+}
+
+// Reads the whole cluster into data, decompressing it if needed.
+static int cluster_fill(const inode_t *node, int cluster, char *data) {
+    memset(data, 0, CLUSTER_SIZE);
+    int pages = cluster_pages(node, cluster);
+
+    if (!cluster_is_packed(node, cluster)) {
+        for (int i = 0; i < pages; ++i) {
+            int pnum = inode_get_pnum(node, cluster_page(cluster, i));
+            if (pnum && !block_unwritten(pnum)) {
+                memcpy(data + i * 4096, blocks_peek_block(pnum), 4096);
+            }
+        }
+        return 0;
+    }
+
+    char packed[CLUSTER_SIZE];
+    const cluster_header_t *hdr = blocks_peek_block(inode_get_pnum(node, cluster_page(cluster, 0)));
+    const codec_t *codec = compress_codec(hdr->codec);
+    if (!codec || hdr->blocks > CLUSTER_PAGES) {
+        return -1;
+    }
+    for (int i = 0; i < hdr->blocks; ++i) {
+        int pnum = inode_get_pnum(node, cluster_page(cluster, i));
+        memcpy(packed + i * 4096, blocks_peek_block(pnum), 4096);
+    }
+    hdr = (cluster_header_t *) packed;
+    // only the blocks read above are filled in
+    if (hdr->size < 0 || hdr->size > hdr->blocks * 4096 - (int) sizeof(cluster_header_t)) {
+        printf("+ cluster_fill(%d) -> corrupt cluster\n", cluster);
+        return -1;
+    }
+    int size = codec->decompress(packed + sizeof(cluster_header_t), hdr->size, data, CLUSTER_SIZE);
+    if (size != hdr->raw_size) {
+        printf("+ cluster_fill(%d) -> corrupt cluster\n", cluster);
+        return -1;
+    }
+    return 0;
+}
+
+// Frees all of the cluster's blocks, leaving holes behind.
+static void cluster_drop(inode_t *node, int cluster) {
+    for (int i = 0; i < CLUSTER_PAGES; ++i) {
+        int pnum = inode_get_pnum(node, cluster_page(cluster, i));
+        if (pnum) {
+            free_block(pnum);
+            inode_set_pnum(node, cluster_page(cluster, i), 0);
+        }
+    }
+}
+
+// Replaces the cluster's blocks with count new blocks holding src.
+// The new blocks are filled in before the old ones are let go of.
+static int cluster_replace(inode_t *node, int cluster, const char *src, int count) {
+    int pnums[CLUSTER_PAGES];
+    for (int i = 0; i < count; ++i) {
+        pnums[i] = alloc_block_near(i ? pnums[i - 1] + 1 : inode_goal(node, cluster_page(cluster, 0)));
+        if (pnums[i] < 0) {
+            while (i-- > 0) {
+                free_block(pnums[i]);
+            }
+            return -1;
+        }
+        memcpy(blocks_get_block(pnums[i]), src + i * 4096, 4096);
+    }
+
+    cluster_drop(node, cluster);
+    for (int i = 0; i < count; ++i) {
+        inode_set_pnum(node, cluster_page(cluster, i), pnums[i]);
+    }
+    return 0;
+}
+
+// Writes the whole cluster from data, compressing it if the file asks for it
+// and it saves at least one block.
+static int cluster_store(inode_t *node, int cluster, const char *data) {
+    int pages = cluster_pages(node, cluster);
+    int len = node->size - cluster * CLUSTER_SIZE;
+    if (len > CLUSTER_SIZE) {
+        len = CLUSTER_SIZE;
+    }
+    if (pages == 0) {
+        return 0;
+    }
+
+    const codec_t *codec = compress_codec(INODE_CODEC(node->flags));
+    int cap = (pages - 1) * 4096 - (int) sizeof(cluster_header_t);
+    if ((node->flags & INODE_COMPRESS) && codec && cap > 0) {
+        char packed[CLUSTER_SIZE];
+        cluster_header_t *hdr = (cluster_header_t *) packed;
+        int size = codec->compress(data, len, packed + sizeof(cluster_header_t), cap);
+        if (size >= 0) {
+            hdr->codec = INODE_CODEC(node->flags);
+            hdr->blocks = bytes_to_blocks(sizeof(cluster_header_t) + size);
+            hdr->unused = 0;
+            hdr->size = size;
+            hdr->raw_size = len;
+            // the rest of the last block goes to disk too
+            int used = sizeof(cluster_header_t) + size;
+            memset(packed + used, 0, hdr->blocks * 4096 - used);
+            if (cluster_replace(node, cluster, packed, hdr->blocks) < 0) {
+                return -1;
+            }
+            get_blocks_flags()[inode_get_pnum(node, cluster_page(cluster, 0))] |= BLOCK_PACKED;
+            node->flags |= INODE_PACKED;
+            printf("+ cluster_store(%d) -> %d of %d blocks\n", cluster, hdr->blocks, pages);
+            return 0;
+        }
+    }
+
+    if (cluster_is_packed(node, cluster)) {
+        return cluster_replace(node, cluster, data, pages);
+    }
+    for (int i = 0; i < pages; ++i) {
+        int pnum = inode_unshare_pnum(node, cluster_page(cluster, i));
+        if (pnum < 0) {
+            return -1;
+        }
+        memcpy(blocks_get_block(pnum), data + i * 4096, 4096);
+    }
+    return 0;
+}
+
+// Gets the cluster from the cache, reading it in if it isn't there.
+// Must hold cache_lock.
+static cluster_cache_entry_t *cluster_load(int inum, const inode_t *node, int cluster) {
+    cluster_cache_entry_t *victim = &cluster_cache[0];
+    for (int i = 0; i < CACHE_SLOTS; ++i) {
+        cluster_cache_entry_t *entry = &cluster_cache[i];
+        if (entry->used && entry->inum == inum && entry->cluster == cluster) {
+            entry->last_use = ++cache_clock;
+            return entry;
+        }
+        if (!entry->used || (victim->used && entry->last_use < victim->last_use)) {
+            victim = entry;
+        }
+    }
+
+    victim->used = 0;
+    if (cluster_fill(node, cluster, victim->data) < 0) {
+        return NULL;
+    }
+    victim->used = 1;
+    victim->inum = inum;
+    victim->cluster = cluster;
+    victim->last_use = ++cache_clock;
+    return victim;
+}
+
+// Reads from a file with compressed clusters. Returns the bytes read.
+int compress_read(int inum, const inode_t *node, char *buf, int size, int offset) {
+    int done = 0;
+    pthread_mutex_lock(&cache_lock);
+    while (done < size) {
+        int pos = offset + done;
+        int chunk = CLUSTER_SIZE - pos % CLUSTER_SIZE;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        cluster_cache_entry_t *entry = cluster_load(inum, node, pos / CLUSTER_SIZE);
+        if (!entry) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        memcpy(buf + done, entry->data + pos % CLUSTER_SIZE, chunk);
+        done += chunk;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return done;
+}
+
+// Writes to a file with compressed clusters, recompressing every cluster
+// the write touches. Returns the bytes written.
+int compress_write(int inum, inode_t *node, const char *buf, int size, int offset) {
+    int done = 0;
+    pthread_mutex_lock(&cache_lock);
+    while (done < size) {
+        int pos = offset + done;
+        int chunk = CLUSTER_SIZE - pos % CLUSTER_SIZE;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        cluster_cache_entry_t *entry = cluster_load(inum, node, pos / CLUSTER_SIZE);
+        if (!entry) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        memcpy(entry->data + pos % CLUSTER_SIZE, buf + done, chunk);
+        if (cluster_store(node, pos / CLUSTER_SIZE, entry->data) < 0) {
+            entry->used = 0;
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        done += chunk;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return done;
+}
+
+// Shrinks a file with compressed clusters. The cluster the file now ends in
+// is taken apart before shrink_inode frees its tail, and written back after.
+int compress_truncate(int inum, inode_t *node, int size) {
+    int cluster = size / CLUSTER_SIZE;
+    int packed = cluster_is_packed(node, cluster);
+    char data[CLUSTER_SIZE];
+
+    if (packed) {
+        if (cluster_fill(node, cluster, data) < 0) {
+            return -1;
+        }
+        cluster_drop(node, cluster);
+    }
+    compress_forget(inum);
+    shrink_inode(node, size);
+
+    if (packed) {
+        int end = size % CLUSTER_SIZE;
+        memset(data + end, 0, CLUSTER_SIZE - end);
+        return cluster_store(node, cluster, data);
+    }
+    return 0;
+}
+
+// Drop all cached clusters of the given file.
+void compress_forget(int inum) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < CACHE_SLOTS; ++i) {
+        if (cluster_cache[i].inum == inum) {
+            cluster_cache[i].used = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
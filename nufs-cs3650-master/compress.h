@@ -0,0 +1,41 @@
+// Transparent compression of file data.
+//
+// Files are split into clusters of CLUSTER_PAGES pages. A cluster of a file
+// with INODE_COMPRESS set is compressed whenever it's written, and stored in
+// as few blocks as it needs; the cluster's remaining page pointers are holes.
+// The first block of a compressed cluster is marked BLOCK_PACKED.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define CLUSTER_PAGES 4
+#define CLUSTER_SIZE (CLUSTER_PAGES * 4096)
+
+#define CODEC_NAME_LENGTH 16
+
+// A compression algorithm.
+// Both functions return the number of bytes written to dst,
+// or -1 if the output doesn't fit in dst_cap bytes.
+typedef struct codec {
+    const char *name;
+    int (*compress)(const char *src, int src_len, char *dst, int dst_cap);
+    int (*decompress)(const char *src, int src_len, char *dst, int dst_cap);
+} codec_t;
+
+// Get the id of the codec with the given name, or -1 if there is none.
+int compress_codec_id(const char *name);
+// Get the codec with the given id, or NULL if there is none.
+const codec_t *compress_codec(int id);
+
+// Read from / write to a file that has compressed clusters,
+// going through the cache of decompressed clusters.
+int compress_read(int inum, const inode_t *node, char *buf, int size, int offset);
+int compress_write(int inum, inode_t *node, const char *buf, int size, int offset);
+// Shrink a file that has compressed clusters to the given size.
+int compress_truncate(int inum, inode_t *node, int size);
+// Drop all cached clusters of the given file.
+void compress_forget(int inum);
+
+#endif
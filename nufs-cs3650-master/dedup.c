@@ -0,0 +1,126 @@
+// Implementation of dedup.h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "dedup.h"
+
+// An entry of the fingerprint index. Entries may be stale (the block was
+// freed or rewritten since), so a match is always checked against the
+// block's actual contents.
+typedef struct dedup_entry {
+    uint32_t hash;
+    int pnum; // 0 if the entry is empty
+} dedup_entry_t;
+
+#define DEDUP_ENTRIES (4096 / (int) sizeof(dedup_entry_t))
+#define DEDUP_PROBES 8
+
+// Fast non-cryptographic hash of a page.
+static uint32_t dedup_hash(const char *page) {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < 4096; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, page + i, sizeof(word));
+        h = (h ^ word) * 0xff51afd7ed558ccdull;
+        h = (h << 31) | (h >> 33);
+    }
+    return h ^ (h >> 32);
+}
+
+// Can the block be shared by a page with the given contents?
+static int dedup_matches(int pnum, const char *page) {
+    return block_refcount(pnum) > 0 &&
+           (get_blocks_flags()[pnum] & BLOCK_DEDUP) &&
+           memcmp(blocks_peek_block(pnum), page, 4096) == 0;
+}
+
+// Finds a block holding the same contents as page, or returns 0.
+static int dedup_find(uint32_t hash, const char *page) {
+    dedup_entry_t *index = get_dedup_index();
+    for (int i = 0; i < DEDUP_PROBES; ++i) {
+        dedup_entry_t *entry = &index[(hash + i) % DEDUP_ENTRIES];
+        if (entry->pnum && entry->hash == hash && dedup_matches(entry->pnum, page)) {
+            return entry->pnum;
+        }
+    }
+    return 0;
+}
+
+// Adds a block to the index, reusing an empty or stale slot if there is one
+// and evicting the first probed slot otherwise.
+static void dedup_insert(uint32_t hash, int pnum) {
+    dedup_entry_t *index = get_dedup_index();
+    dedup_entry_t *slot = &index[hash % DEDUP_ENTRIES];
+    for (int i = 0; i < DEDUP_PROBES; ++i) {
+        dedup_entry_t *entry = &index[(hash + i) % DEDUP_ENTRIES];
+        if (entry->pnum == 0 || entry->pnum == pnum ||
+            !(get_blocks_flags()[entry->pnum] & BLOCK_DEDUP)) {
+            slot = entry;
+            break;
+        }
+    }
+    slot->hash = hash;
+    slot->pnum = pnum;
+    get_blocks_flags()[pnum] |= BLOCK_DEDUP;
+}
+
+// Writes one page's worth of data, sharing an identical block if there is
+// one and writing to (and indexing) the page's own block otherwise.
+static int dedup_write_page(inode_t *node, const char *buf, int size, int offset) {
+    char page[4096];
+    int start = offset - offset % 4096;
+    int pnum = inode_get_pnum(node, start);
+
+    if (size < 4096) {
+        if (pnum && !block_unwritten(pnum)) {
+            memcpy(page, blocks_peek_block(pnum), 4096);
+        } else {
+            memset(page, 0, 4096);
+        }
+    }
+    memcpy(page + offset % 4096, buf, size);
+
+    uint32_t hash = dedup_hash(page);
+    int match = dedup_find(hash, page);
+    if (match && match == pnum) {
+        // already holds these contents
+        return 0;
+    }
+    if (match && ref_block(match) == 0) {
+        printf("+ dedup_write_page(%d) -> shares %d\n", offset / 4096, match);
+        inode_set_pnum(node, start, match);
+        if (pnum) {
+            free_block(pnum);
+        }
+        return 0;
+    }
+
+    pnum = inode_unshare_pnum(node, start);
+    if (pnum < 0) {
+        return -1;
+    }
+    memcpy(blocks_get_block(pnum), page, 4096);
+    dedup_insert(hash, pnum);
+    return 0;
+}
+
+// Write to a file with INODE_DEDUP set. Returns the bytes written.
+int dedup_write(inode_t *node, const char *buf, int size, int offset) {
+    int done = 0;
+    while (done < size) {
+        int pos = offset + done;
+        int chunk = 4096 - pos % 4096;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        if (dedup_write_page(node, buf + done, chunk, pos) < 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+    return done;
+}
@@ -0,0 +1,16 @@
+// Inline deduplication of file data.
+//
+// Pages written to files with INODE_DEDUP set are hashed and looked up in a
+// fingerprint index kept in the last block of the image. If a block with the
+// same contents already exists, the page shares it (see ref_block) instead
+// of getting a block of its own.
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "inode.h"
+
+// Write to a file with INODE_DEDUP set. Returns the bytes written.
+int dedup_write(inode_t *node, const char *buf, int size, int offset);
+
+#endif
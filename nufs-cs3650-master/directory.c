@@ -4,95 +4,201 @@
 #include "blocks.h"
 #include "inode.h"
 #include "directory.h"
+#include "path.h"
+#include "bitmap.h"
+#include "timestamps.h"
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 
 // Initialize root.
 void directory_init() {
-    inode_t *root = get_inode(alloc_inode());
+    int inum = alloc_inode();
+    inode_t *root = get_inode(inum);
     root->mode = 040755;
+    times_init(inum);
 }
 
 // Finds the inum of the given inode with the given name.
-int directory_lookup(inode_t *dd, const char *name) {
-    // Root directory
-    if (!strcmp(name, "")) {
-        return 0;
-    } else {
-        dirent_t *lower_directs = blocks_get_block(dd->direct_pointers[0]);
-        for (int i = 0; i < 64; ++i) {
-            dirent_t cur = lower_directs[i];
-            if (strcmp(name, cur.name) == 0 && cur.used) {
-                return cur.inum;
+int directory_lookup(const inode_t *dd, const char *name) {
+    return directory_lookup_len(dd, name, strlen(name));
+}
+
+// Gets the offset of the record after the one at off, stopping at the end
+// of the block if the record is damaged.
+static int dirent_next(const char *block, int off) {
+    int rec_len = ((const dirent_t *) (block + off))->rec_len;
+    return rec_len < DIRENT_LEN(0) ? BLOCK_SIZE : off + rec_len;
+}
+
+// Gets the block holding the given block of the directory for reading.
+static const char *directory_peek_block(const inode_t *dd, int index) {
+    return blocks_peek_block(inode_get_pnum(dd, index * BLOCK_SIZE));
+}
+
+// Finds the inum of the given inode with the name made of the first len
+// characters of name, which doesn't have to be null terminated.
+int directory_lookup_len(const inode_t *dd, const char *name, int len) {
+    if (len >= DIR_NAME_LENGTH) {
+        return -1;
+    }
+    for (int ii = 0; ii < dd->size / BLOCK_SIZE; ++ii) {
+        const char *block = directory_peek_block(dd, ii);
+        for (int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off)) {
+            const dirent_t *cur = (const dirent_t *) (block + off);
+            if (cur->name_len == len && memcmp(name, cur->name, len) == 0) {
+                return cur->inum;
             }
         }
-        // Noting found :(
-        return -1;
     }
+    // Noting found :(
+    return -1;
 }
 
 // Finds the node at the given path
 int tree_lookup(const char *path) {
+    return tree_lookup_len(path, strlen(path));
+}
+
+// Finds the node at the path made of the first len characters of path.
+// The components are looked up in place, nothing is copied. Returns
+// -ENOENT if a component is missing, or -ENOTDIR if one before the last
+// isn't a directory.
+int tree_lookup_len(const char *path, int len) {
     int inum = 0;
-    // parsing the path
-    slist_t *path_list = s_explode(path, '/');
-    while (path_list) {
-        inum = directory_lookup(get_inode(inum), path_list->data);
-        path_list = path_list->next;
+    path_iter_t it;
+    const char *name;
+    int name_len;
+
+    path_iter_init(&it, path, len);
+    while ((name_len = path_next(&it, &name)) >= 0) {
+        const inode_t *dd = peek_inode(inum);
+        if (!S_ISDIR(dd->mode)) {
+            return -ENOTDIR;
+        }
+        inum = directory_lookup_len(dd, name, name_len);
+        if (inum < 0) {
+            return -ENOENT;
+        }
     }
     return inum;
 }
 
-// Makes new directory in the directory dd with the given inum
-int directory_put(inode_t *dd, const char *name, int inum) {
-
-    int entry_count = dd->size / DIR_SIZE;
+// Finds a record with room for a new one of need bytes: either an unused
+// one, or a used one with at least that much free space after its name.
+// Returns the index of the directory block it's in and sets *rec_off,
+// or returns -1 if every block is full.
+static int directory_find_room(inode_t *dd, int need, int *rec_off) {
+    for (int ii = 0; ii < dd->size / BLOCK_SIZE; ++ii) {
+        const char *block = directory_peek_block(dd, ii);
+        for (int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off)) {
+            const dirent_t *cur = (const dirent_t *) (block + off);
+            int used = cur->name_len ? DIRENT_LEN(cur->name_len) : 0;
+            if (cur->rec_len - used >= need) {
+                *rec_off = off;
+                return ii;
+            }
+        }
+    }
+    return -1;
+}
 
-    dirent_t *blockStart = blocks_get_block(dd->direct_pointers[0]);
-    int flag = 0;
+// Adds an empty block to the end of the directory.
+static int directory_grow(inode_t *dd) {
+    if (dd->size + BLOCK_SIZE > INODE_MAX_SIZE) {
+        return -1;
+    }
+    int pnum = inode_unshare_pnum(dd, dd->size);
+    if (pnum < 0) {
+        return -1;
+    }
+    dirent_t *first = blocks_get_meta_block(pnum);
+    first->inum = 0;
+    first->rec_len = BLOCK_SIZE;
+    first->name_len = 0;
+    first->file_type = 0;
+    dd->size += BLOCK_SIZE;
+    return 0;
+}
 
-    dirent_t dir;
-    strncpy(dir.name, name, DIR_NAME_LENGTH);
-    dir.inum = inum;
-    dir.used = 1;
+// Makes new directory in the directory dd with the given inum
+// Returns -1 if the name is too long or the directory can't grow.
+int directory_put(inode_t *dd, const char *name, int inum) {
+    int len = strlen(name);
+    if (len == 0 || len >= DIR_NAME_LENGTH) {
+        return -1;
+    }
 
-    for (int i = 1; i < entry_count; ++i) {
-        if (blockStart[i].used == 0) {
-            flag = 1;
-            blockStart[i] = dir;
+    int off;
+    int index = directory_find_room(dd, DIRENT_LEN(len), &off);
+    if (index < 0) {
+        index = dd->size / BLOCK_SIZE;
+        off = 0;
+        if (directory_grow(dd) < 0) {
+            return -1;
         }
     }
-    if (!flag) {
-        blockStart[entry_count] = dir;
-        dd->size = dd->size + DIR_SIZE;
+
+    char *block = blocks_get_meta_block(inode_get_pnum(dd, index * BLOCK_SIZE));
+    dirent_t *cur = (dirent_t *) (block + off);
+    if (cur->name_len) {
+        // split the free space off the end of the record
+        int used = DIRENT_LEN(cur->name_len);
+        dirent_t *rest = (dirent_t *) (block + off + used);
+        rest->rec_len = cur->rec_len - used;
+        cur->rec_len = used;
+        cur = rest;
     }
+    cur->inum = inum;
+    cur->name_len = len;
+    cur->file_type = (peek_inode(inum)->mode >> 12) & 0xf; // same as IFTODT
+    memcpy(cur->name, name, len);
     return 0;
 }
 
 // Deletes the given directory
+// The record is merged into the one before it, so the space can be reused.
 int directory_delete(inode_t *dd, const char *name) {
-    dirent_t *entries = blocks_get_block(dd->direct_pointers[0]);
-    for (int i = 0; i < dd->size / DIR_SIZE; ++i) {
-        if (strcmp(entries[i].name, name) == 0) {
-            entries[i].used = 0;
+    int len = strlen(name);
+    for (int ii = 0; ii < dd->size / BLOCK_SIZE; ++ii) {
+        const char *block = directory_peek_block(dd, ii);
+        int prev = -1;
+        for (int off = 0; off < BLOCK_SIZE; prev = off, off = dirent_next(block, off)) {
+            const dirent_t *cur = (const dirent_t *) (block + off);
+            if (cur->name_len != len || memcmp(name, cur->name, len) != 0) {
+                continue;
+            }
+
+            char *entries = blocks_get_meta_block(inode_get_pnum(dd, ii * BLOCK_SIZE));
+            dirent_t *entry = (dirent_t *) (entries + off);
+            if (prev >= 0) {
+                ((dirent_t *) (entries + prev))->rec_len += entry->rec_len;
+            } else {
+                entry->inum = 0;
+                entry->name_len = 0;
+            }
             return 0;
         }
     }
     return -1;
 }
 
-// Gets a slist of directories at the given path
+// Gets a slist of directories at the given path.
+// The list lives in the request arena.
 slist_t *directory_list(const char *path) {
     int current_dir = tree_lookup(path);
-    inode_t *current_inode = get_inode(current_dir);
+    const inode_t *current_inode = peek_inode(current_dir);
 
-    int dir_count = current_inode->size / DIR_SIZE;
-    dirent_t *dirs = blocks_get_block(current_inode->direct_pointers[0]);
     slist_t *list = NULL;
-    for (int i = 0; i < dir_count; ++i) {
-        if (dirs[i].used) {
-            list = s_cons(dirs[i].name, list);
+    for (int ii = 0; ii < current_inode->size / BLOCK_SIZE; ++ii) {
+        const char *block = directory_peek_block(current_inode, ii);
+        for (int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off)) {
+            const dirent_t *cur = (const dirent_t *) (block + off);
+            if (cur->name_len) {
+                list = s_cons_arena_len(cur->name, cur->name_len, list);
+            }
         }
     }
     return list;
@@ -100,7 +206,9 @@ slist_t *directory_list(const char *path) {
 
 // Prints the first directory name?
 void print_directory(inode_t *dd) {
-    dirent_t *dirs = blocks_get_block(dd->direct_pointers[0]);
-    printf("%s", dirs[0].name);
-
+    if (dd->size == 0) {
+        return;
+    }
+    const dirent_t *first = (const dirent_t *) directory_peek_block(dd, 0);
+    printf("%.*s", first->name_len, first->name);
 }
@@ -3,23 +3,36 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME_LENGTH 48
+#define DIR_NAME_LENGTH 256 // longest name + 1
+
+#include <stdint.h>
 
 #include "slist.h"
 #include "blocks.h"
 #include "inode.h"
 
+// A directory is a list of variable length records filling whole blocks.
+// Each record takes up rec_len bytes, which is at least DIRENT_LEN(name_len)
+// and covers any free space left after it. Deleting an entry merges it into
+// the record before it; the first record of a block is kept, but marked
+// unused with a name_len of 0. Inserting reuses an unused record or splits
+// the free space off the end of a used one.
 typedef struct dirent {
-    char name[DIR_NAME_LENGTH];// The name of the directory
-    int  inum; // the number of the inode_t in the inode_t table?
-    char used; // is this directory entry being used?
+    int inum; // the number of the inode_t in the inode_t table
+    uint16_t rec_len; // bytes from the start of this record to the next
+    uint8_t name_len; // 0 if the record is unused
+    uint8_t file_type; // DT_* type of the inode_t
+    char name[]; // not null terminated
 } dirent_t;
 
-#define DIR_SIZE sizeof(dirent_t)
+// Bytes needed by a record with a name of the given length, 4 byte aligned
+#define DIRENT_LEN(name_len) ((int) ((sizeof(dirent_t) + (name_len) + 3) & ~3))
 
 void directory_init();
-int directory_lookup(inode_t *dd, const char *name);
+int directory_lookup(const inode_t *dd, const char *name);
+int directory_lookup_len(const inode_t *dd, const char *name, int len);
 int tree_lookup(const char *path);
+int tree_lookup_len(const char *path, int len);
 int directory_put(inode_t *dd, const char *name, int inum);
 int directory_delete(inode_t *dd, const char *name);
 slist_t *directory_list(const char *path);
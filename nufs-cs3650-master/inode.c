@@ -1,10 +1,13 @@
 // inode_t implementation
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "timestamps.h"
 
 // prints some stats about the inode
 void print_inode(inode_t *node) {
@@ -12,92 +15,414 @@ void print_inode(inode_t *node) {
     printf("Node size: %d\n", node->size);
 }
 
-// Gets the inode from the given inum
+// Number of inodes that fit in the inode table
+int inode_count() {
+    int table_size = BLOCK_SIZE - (int) ((const char *) peek_inode_table() - (const char *) blocks_peek_block(0));
+    return table_size / sizeof(inode_t);
+}
+
+// Gets the inode from the given inum for changing it
 inode_t* get_inode(int inum) {
-    inode_t *inodes = get_inode_bitmap() + 32;
+    inode_t *inodes = get_inode_table();
     return &inodes[inum];
 }
 
-// Allocaes a new inode
-int alloc_inode() {
-    int nodenum;
-    for (int i = 0; i < 256; ++i) {
-        if (!bitmap_get(get_inode_bitmap(), i)) { // Free
-            bitmap_put(get_inode_bitmap(), i, 1);
-            nodenum = i;
-            break;
+// Gets the inode from the given inum for reading only
+const inode_t *peek_inode(int inum) {
+    const inode_t *inodes = peek_inode_table();
+    return &inodes[inum];
+}
+
+// Gets the inum of the given inode
+static int inode_num(inode_t *node) {
+    return node - (const inode_t *) peek_inode_table();
+}
+
+// Gets the allocation group of the given inum.
+// Each group gets an equal slice of the inode table, the last one
+// also gets whatever is left over.
+int inode_group(int inum) {
+    int group = inum / (inode_count() / BLOCK_GROUPS);
+    return group < BLOCK_GROUPS ? group : BLOCK_GROUPS - 1;
+}
+
+// Number of free inodes in the given group
+static int group_free_inodes(int group) {
+    int per_group = inode_count() / BLOCK_GROUPS;
+    int end = group == BLOCK_GROUPS - 1 ? inode_count() : (group + 1) * per_group;
+    int free = 0;
+    for (int i = group * per_group; i < end; ++i) {
+        free += !bitmap_get(peek_inode_bitmap(), i);
+    }
+    return free;
+}
+
+// Number of free inodes
+int free_inode_count() {
+    int free = 0;
+    for (int g = 0; g < BLOCK_GROUPS; ++g) {
+        free += group_free_inodes(g);
+    }
+    return free;
+}
+
+// Can an inode point at the block? 0 is a hole.
+static int block_usable(int pnum) {
+    return pnum == 0 || (pnum > 0 && pnum < BLOCK_COUNT && !block_reserved(pnum));
+}
+
+// Finds an inode in use that points at a block it can't have, one with a
+// fixed purpose or past the end of the image. Returns -1 if there is none.
+int inode_find_bad_block() {
+    for (int inum = 0; inum < inode_count(); ++inum) {
+        if (!bitmap_get(peek_inode_bitmap(), inum)) {
+            continue;
+        }
+        const inode_t *node = peek_inode(inum);
+        if (!block_usable(node->direct_pointers[0]) ||
+            !block_usable(node->direct_pointers[1]) ||
+            !block_usable(node->indirect_pointer)) {
+            return inum;
+        }
+        if (node->indirect_pointer) {
+            const int *indirect_pointers = blocks_peek_block(node->indirect_pointer);
+            for (int i = 0; i < BLOCK_SIZE / (int) sizeof(int); ++i) {
+                if (!block_usable(indirect_pointers[i])) {
+                    return inum;
+                }
+            }
         }
     }
+    return -1;
+}
+
+// Claims a free inode in the given group, or returns -1 if there is none.
+// The bit is claimed atomically, so threads creating files at the same time
+// never get the same inode.
+static int group_claim_inode(int group) {
+    int per_group = inode_count() / BLOCK_GROUPS;
+    int end = group == BLOCK_GROUPS - 1 ? inode_count() : (group + 1) * per_group;
+    for (int i = group * per_group; i < end; ++i) {
+        if (!bitmap_get(peek_inode_bitmap(), i) && bitmap_claim_atomic(get_inode_bitmap(), i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Picks the group for a new top-level directory: the one with the most free
+// inodes, then the most free blocks, so separate trees land in separate parts
+// of the image.
+static int spread_group() {
+    int best = 0;
+    int best_inodes = -1;
+    int best_blocks = -1;
+    for (int g = 0; g < BLOCK_GROUPS; ++g) {
+        int inodes = group_free_inodes(g);
+        int blocks = group_free_blocks(g);
+        if (inodes > best_inodes || (inodes == best_inodes && blocks > best_blocks)) {
+            best = g;
+            best_inodes = inodes;
+            best_blocks = blocks;
+        }
+    }
+    return best;
+}
+
+// Allocates a new inode in the root group
+int alloc_inode() {
+    return alloc_inode_near(0, 0);
+}
+
+// Allocates a new inode for an object with the given mode in the directory
+// with the given inum. It goes in the parent's group, unless it's a new
+// top-level directory, and its first page goes in its own group.
+int alloc_inode_near(int parent, int mode) {
+    int group = inode_group(parent);
+    if (parent == 0 && S_ISDIR(mode)) {
+        group = spread_group();
+    }
+
+    int nodenum = -1;
+    for (int i = 0; i < BLOCK_GROUPS && nodenum < 0; ++i) {
+        nodenum = group_claim_inode((group + i) % BLOCK_GROUPS);
+    }
+    if (nodenum < 0) {
+        return -1;
+    }
+
     inode_t *new_node = get_inode(nodenum);
     new_node->refs = 1;
     new_node->size = 0;
     new_node->mode = 0;
-    new_node->direct_pointers[0] = alloc_block();
+    new_node->flags = 0;
+    new_node->direct_pointers[0] = alloc_block_near(group_first_block(inode_group(nodenum)));
+    if (new_node->direct_pointers[0] > 0) {
+        memset(blocks_get_block(new_node->direct_pointers[0]), 0, BLOCK_SIZE);
+    }
+    new_node->direct_pointers[1] = 0;
+    new_node->indirect_pointer = 0;
 
     return nodenum;
 }
 
+// Gets the block a new page at fpn should preferably go in: right after the
+// page before it, or else at the start of the inode's group.
+int inode_goal(inode_t *node, int fpn) {
+    if (fpn / 4096 > 0) {
+        int prev = inode_get_pnum(node, fpn - 4096);
+        if (prev) {
+            return prev + 1;
+        }
+    }
+    return group_first_block(inode_group(inode_num(node)));
+}
+
 // marks the inode_t as free in the bitmap and then clears the pointer locations
 void free_inode(int inum) {
     void *bitmap = get_inode_bitmap();
     shrink_inode(get_inode(inum), 0);
-    free_block(get_inode(inum)->direct_pointers[0]);
-    bitmap_put(bitmap, inum, 0);
+    if (get_inode(inum)->direct_pointers[0]) {
+        free_block(get_inode(inum)->direct_pointers[0]);
+    }
+    times_forget(inum);
+    bitmap_put_atomic(bitmap, inum, 0);
 }
 
 // Increases the size of inode
-// If too large, allocates a new page
+// The new pages are holes, which read as zeros until they're written,
+// so growing never runs out of space.
 int grow_inode(inode_t *node, int size) {
-    int pages = node->size / 4096;
-    int newPages = size / 4096;
-    for (int i = pages + 1; i <= newPages; i++) {
-        // Direct ptrs
-        if (i < 2) {
-            node->direct_pointers[i] = alloc_block(); //alloc a page
-        }
-        else if (node->indirect_pointer == 0 ) {
-            node->indirect_pointer = alloc_block();
-            int *indirect_pointers = blocks_get_block(node->indirect_pointer); //retrieve memory loc.
-            indirect_pointers[i - 2] = alloc_block(); //add another page
-        }
-        else {
-            int *indirect_pointers = blocks_get_block(node->indirect_pointer); //retrieve memory loc.
-            indirect_pointers[i - 2] = alloc_block(); //add another page
-        }
+    if (size > INODE_MAX_SIZE) {
+        return -1;
     }
     node->size = size;
     return 0;
 }
 
+// frees a page unless it's a hole
+static void free_page(int pnum) {
+    if (pnum) {
+        free_block(pnum);
+    }
+}
+
+// Gets the index of the last page that has a block, which can be past the
+// end of the file if it was preallocated with FALLOC_FL_KEEP_SIZE.
+// Never less than 2 if there's an indirect block, so shrinking frees it.
+static int inode_last_page(inode_t *node) {
+    if (node->indirect_pointer) {
+        const int *indirect_pointers = blocks_peek_block(node->indirect_pointer);
+        for (int i = INODE_MAX_PAGES - 3; i > 0; --i) {
+            if (indirect_pointers[i]) {
+                return i + 2;
+            }
+        }
+        return 2;
+    }
+    return node->direct_pointers[1] ? 1 : 0;
+}
+
 // shrinks an inode_t by the given size
+// Pages preallocated past the old end are freed too.
 int shrink_inode(inode_t *node, int size) {
     int pages = node->size / 4096;
     int newPages = size / 4096;
+    if (inode_last_page(node) > pages) {
+        pages = inode_last_page(node);
+    }
     for (int i = pages; i > newPages; i--) {
         if (i < 2) {
-            free_block(node->direct_pointers[i]);
+            free_page(node->direct_pointers[i]);
             node->direct_pointers[i] = 0;
+        } else if (node->indirect_pointer == 0) {
+            // the indirect pages are all holes
         } else if (i == 2) {
+            int *indirect_pointers = blocks_get_meta_block(node->indirect_pointer);
+            free_page(indirect_pointers[0]);
             free_block(node->indirect_pointer);
             node->indirect_pointer = 0;
 
         } else {
-            int *indirect_pointers = blocks_get_block(node->indirect_pointer);
-            free_block(indirect_pointers[i - 2]);
+            int *indirect_pointers = blocks_get_meta_block(node->indirect_pointer);
+            free_page(indirect_pointers[i - 2]);
             indirect_pointers[i - 2] = 0;
         }
     }
     node->size = size;
+
+    // clear what's left of the last page past the new end,
+    // so it reads as zeros if the file grows again
+    if (size % 4096 && inode_get_pnum(node, size)) {
+        int pnum = inode_unshare_pnum(node, size);
+        if (pnum < 0) {
+            return -1;
+        }
+        memset((char *) blocks_get_block(pnum) + size % 4096, 0, 4096 - size % 4096);
+    }
     return 0;
 }
 
-// gets the page number for the given inode
-int inode_get_pnum(inode_t *node, int fpn) {
+// gets the page number for the given inode, 0 means the page is a hole
+int inode_get_pnum(const inode_t *node, int fpn) {
     // Direct
     if (fpn / 4096 < 2) {
         return node->direct_pointers[fpn / 4096];
+    } else if (node->indirect_pointer == 0) {
+        return 0;
     } else { // Indirect
-        int *indirect_pointers = blocks_get_block(node->indirect_pointer);
+        const int *indirect_pointers = blocks_peek_block(node->indirect_pointer);
         return indirect_pointers[fpn / 4096 - 2];
     }
-}
\ No newline at end of file
+}
+
+// sets the page number for the given inode, allocating the indirect
+// block if it doesn't exist yet
+int inode_set_pnum(inode_t *node, int fpn, int pnum) {
+    // Direct
+    if (fpn / 4096 < 2) {
+        node->direct_pointers[fpn / 4096] = pnum;
+        return 0;
+    }
+    // Indirect
+    if (node->indirect_pointer == 0) {
+        node->indirect_pointer = alloc_block_near(inode_goal(node, fpn));
+        if (node->indirect_pointer < 0) {
+            node->indirect_pointer = 0;
+            return -1;
+        }
+        memset(blocks_get_meta_block(node->indirect_pointer), 0, BLOCK_SIZE);
+    }
+    int *indirect_pointers = blocks_get_meta_block(node->indirect_pointer);
+    indirect_pointers[fpn / 4096 - 2] = pnum;
+    return 0;
+}
+
+// Makes sure the page holding fpn belongs to this inode alone before it is
+// written to, copying it away from any clones that share it and filling
+// it in if it's a hole.
+// Returns the page number to write to, or -1 if no block could be allocated.
+int inode_unshare_pnum(inode_t *node, int fpn) {
+    int pnum = inode_get_pnum(node, fpn);
+    if (pnum == 0) {
+        pnum = alloc_block_near(inode_goal(node, fpn));
+        if (pnum < 0 || inode_set_pnum(node, fpn, pnum) < 0) {
+            return -1;
+        }
+        memset(blocks_get_block(pnum), 0, BLOCK_SIZE);
+        return pnum;
+    }
+    if (block_refcount(pnum) <= 1) {
+        if (block_unwritten(pnum)) {
+            // preallocated: its old contents were never meant to be seen
+            memset(blocks_get_block(pnum), 0, BLOCK_SIZE);
+            get_blocks_flags()[pnum] &= ~BLOCK_UNWRITTEN;
+        }
+        return pnum;
+    }
+
+    int copy = alloc_block_near(inode_goal(node, fpn));
+    if (copy < 0) {
+        return -1;
+    }
+    if (block_unwritten(pnum)) {
+        memset(blocks_get_block(copy), 0, BLOCK_SIZE);
+    } else {
+        memcpy(blocks_get_block(copy), blocks_peek_block(pnum), BLOCK_SIZE);
+    }
+    free_block(pnum);
+    inode_set_pnum(node, fpn, copy);
+    return copy;
+}
+
+// Gives the holes among the pages from start up to end blocks of their own,
+// in runs of consecutive blocks that follow the page before them. The blocks
+// are marked unwritten, so they read as zeros and are only filled in once
+// they're written. Returns -1 if space runs out, keeping what was allocated.
+int inode_preallocate(inode_t *node, int start, int end) {
+    int fpn = start - start % 4096;
+    while (fpn < end) {
+        if (inode_get_pnum(node, fpn)) {
+            fpn += 4096;
+            continue;
+        }
+        int holes = 1;
+        while (fpn + holes * 4096 < end && inode_get_pnum(node, fpn + holes * 4096) == 0) {
+            holes++;
+        }
+
+        int got;
+        int first = alloc_run_near(inode_goal(node, fpn), holes, &got);
+        if (first < 0) {
+            return -1;
+        }
+        for (int i = 0; i < got; ++i, fpn += 4096) {
+            get_blocks_flags()[first + i] |= BLOCK_UNWRITTEN;
+            if (inode_set_pnum(node, fpn, first + i) < 0) {
+                for (int j = i; j < got; ++j) {
+                    free_block(first + j);
+                }
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Frees the pages that lie entirely between start and end, turning them
+// into holes, and zeroes the parts of the pages at the edges that are in
+// the range. Returns -1 if an edge page is shared and can't be copied.
+int inode_punch_hole(inode_t *node, int start, int end) {
+    int fpn = start - start % 4096;
+    for (; fpn < end; fpn += 4096) {
+        int pnum = inode_get_pnum(node, fpn);
+        if (pnum == 0) {
+            continue;
+        }
+        int from = fpn < start ? start - fpn : 0;
+        int to = fpn + 4096 > end ? end - fpn : 4096;
+        if (from == 0 && to == 4096) {
+            inode_set_pnum(node, fpn, 0);
+            free_block(pnum);
+        } else if (!block_unwritten(pnum)) {
+            pnum = inode_unshare_pnum(node, fpn);
+            if (pnum < 0) {
+                return -1;
+            }
+            memset((char *) blocks_get_block(pnum) + from, 0, to - from);
+        }
+    }
+    return 0;
+}
+
+// Makes the page at dst_fpn in dst refer to the same block as the page at
+// src_fpn in src, dropping whatever dst had there before.
+// Falls back to copying the data if the block can't take another reference.
+int inode_share_page(inode_t *dst, int dst_fpn, inode_t *src, int src_fpn) {
+    int pnum = inode_get_pnum(src, src_fpn);
+    int old = inode_get_pnum(dst, dst_fpn);
+    if (old == pnum) {
+        return 0;
+    }
+
+    if (pnum == 0) {
+        // nothing to share, the page becomes a hole
+    } else if (ref_block(pnum) < 0) {
+        int copy = alloc_block_near(inode_goal(dst, dst_fpn));
+        if (copy < 0) {
+            return -1;
+        }
+        if (block_unwritten(pnum)) {
+            memset(blocks_get_block(copy), 0, BLOCK_SIZE);
+        } else {
+            memcpy(blocks_get_block(copy), blocks_peek_block(pnum), BLOCK_SIZE);
+        }
+        pnum = copy;
+    }
+    if (inode_set_pnum(dst, dst_fpn, pnum) < 0) {
+        free_page(pnum);
+        return -1;
+    }
+    free_page(old);
+    return 0;
+}
@@ -6,6 +6,19 @@
 #include "blocks.h"
 #include <time.h>
 
+// inode_t flags
+#define INODE_COMPRESS 0x1 // compress data written to this file
+#define INODE_PACKED 0x2 // some of this file's clusters are compressed
+#define INODE_DEDUP 0x4 // share blocks with identical contents
+#define INODE_CODEC(flags) (((flags) >> 8) & 0xff) // codec to compress with
+#define INODE_SET_CODEC(flags, id) (((flags) & ~0xff00) | ((id) << 8))
+// flags new files inherit from their directory
+#define INODE_INHERITED (INODE_COMPRESS | INODE_DEDUP | 0xff00)
+
+// Largest file size. The page holding byte size / 4096 * 4096 has to have
+// a pointer: 2 direct ones and a block of indirect ones.
+#define INODE_MAX_PAGES (2 + 4096 / (int) sizeof(int))
+#define INODE_MAX_SIZE (INODE_MAX_PAGES * 4096 - 1)
 
 typedef struct inode {
     int refs; // reference count
@@ -13,14 +26,27 @@ typedef struct inode {
     int size; // bytes
     int direct_pointers[2]; // direct pointers
     int indirect_pointer; // single indirect pointer
+    int flags; // INODE_* flags
 } inode_t;
 
 void print_inode(inode_t *node);
+int inode_count();
+int free_inode_count();
+int inode_find_bad_block();
 inode_t *get_inode(int inum);
+const inode_t *peek_inode(int inum);
 int alloc_inode();
+int alloc_inode_near(int parent, int mode);
+int inode_group(int inum);
+int inode_goal(inode_t *node, int fpn);
 void free_inode();
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
-int inode_get_pnum(inode_t *node, int fpn);
+int inode_get_pnum(const inode_t *node, int fpn);
+int inode_set_pnum(inode_t *node, int fpn, int pnum);
+int inode_unshare_pnum(inode_t *node, int fpn);
+int inode_share_page(inode_t *dst, int dst_fpn, inode_t *src, int src_fpn);
+int inode_preallocate(inode_t *node, int start, int end);
+int inode_punch_hole(inode_t *node, int start, int end);
 
 #endif
\ No newline at end of file
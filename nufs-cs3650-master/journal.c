@@ -0,0 +1,302 @@
+// Implementation of journal.h
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4e554a4c // "NUJL"
+#define JOURNAL_CAPACITY (JOURNAL_BLOCKS - 1) // block images per transaction
+#define JOURNAL_SHARED 3 // block 0, the timestamps and the dedup index
+#define JOURNAL_OP_SPACE (JOURNAL_CAPACITY - JOURNAL_SHARED) // for other blocks
+
+// The first block of the journal. The block images follow it in order.
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count; // block images in the journal
+    int32_t targets[JOURNAL_CAPACITY]; // home block of each image
+    uint64_t checksum; // of the above and the images
+} journal_header_t;
+
+// Operations hold update_lock shared, commits take it exclusively
+// just long enough to copy the transaction's blocks.
+static pthread_rwlock_t update_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static int committing = 0;
+static unsigned long running_tid = 1; // transaction new changes go into
+static unsigned long committed_tid = 0; // last transaction that's durable
+
+static uint8_t *tx_blocks = NULL; // running transaction, BLOCK_BITMAP_SIZE bytes
+
+// Room in the running transaction. tx_count doesn't include the shared
+// blocks, which always have room.
+static pthread_mutex_t credit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t credits_returned = PTHREAD_COND_INITIALIZER;
+static int tx_count = 0; // other blocks in the running transaction
+static int credits_held = 0; // reserved by operations in progress
+static uint32_t sequence = 0; // of the last transaction in the journal
+static int data_written = 0; // data written back since the last commit
+
+// Checksums a header and the block images it describes.
+static uint64_t journal_checksum(const journal_header_t *hdr, const char *images) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ hdr->sequence;
+    h = (h ^ hdr->count) * 0xff51afd7ed558ccdull;
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        h = (h ^ (uint32_t) hdr->targets[i]) * 0xff51afd7ed558ccdull;
+    }
+    for (uint32_t i = 0; i < hdr->count * BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, images + i, sizeof(word));
+        h = (h ^ word) * 0xff51afd7ed558ccdull;
+        h = (h << 31) | (h >> 33);
+    }
+    return h;
+}
+
+// Is the header one written by journal_write, for blocks outside the journal?
+static int header_valid(const journal_header_t *hdr) {
+    if (hdr->magic != JOURNAL_MAGIC || hdr->count < 1 || hdr->count > JOURNAL_CAPACITY) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        int target = hdr->targets[i];
+        if (target < 0 || target >= BLOCK_COUNT ||
+            (target >= JOURNAL_START && target < JOURNAL_START + JOURNAL_BLOCKS)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replay the journal after the disk image is opened.
+void journal_init() {
+    tx_blocks = calloc(BLOCK_BITMAP_SIZE, 1);
+    assert(tx_blocks);
+    const journal_header_t *hdr = blocks_peek_block(JOURNAL_START);
+    if (!header_valid(hdr)) {
+        return;
+    }
+    sequence = hdr->sequence;
+
+    int count = hdr->count;
+    char *images = malloc(count * BLOCK_SIZE);
+    assert(images);
+    for (int i = 0; i < count; ++i) {
+        memcpy(images + i * BLOCK_SIZE, blocks_peek_block(JOURNAL_START + 1 + i), BLOCK_SIZE);
+    }
+    if (journal_checksum(hdr, images) != hdr->checksum) {
+        // torn write of a transaction that never committed
+        printf("+ journal_init() -> transaction %u incomplete\n", hdr->sequence);
+        free(images);
+        return;
+    }
+
+    int targets[JOURNAL_CAPACITY];
+    for (int i = 0; i < count; ++i) {
+        targets[i] = hdr->targets[i];
+        memcpy(blocks_get_block(targets[i]), images + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    blocks_flush(targets, count);
+    blocks_barrier();
+    free(images);
+    printf("+ journal_init() -> replayed %d blocks of transaction %u\n", count, sequence);
+}
+
+// Writes a transaction of count block images to the journal,
+// without waiting for it to reach the disk.
+static void journal_write(const int *targets, const char *images, int count) {
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    journal_header_t *hdr = (journal_header_t *) block;
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->sequence = ++sequence;
+    hdr->count = count;
+    for (int i = 0; i < count; ++i) {
+        hdr->targets[i] = targets[i];
+    }
+    hdr->checksum = journal_checksum(hdr, images);
+
+    for (int i = 0; i < count; ++i) {
+        blocks_write_through(JOURNAL_START + 1 + i, images + i * BLOCK_SIZE);
+    }
+    blocks_write_through(JOURNAL_START, block);
+}
+
+// Copies the running transaction's blocks and starts a new one, then writes
+// the copies to the journal and on to their homes. journal_begin keeps the
+// transaction small enough to go into the journal in one piece.
+static void commit_transaction() {
+    int targets[JOURNAL_CAPACITY];
+    int count = 0;
+
+    pthread_rwlock_wrlock(&update_lock);
+    for (int bnum = 0; bnum < BLOCK_COUNT; ++bnum) {
+        if (bitmap_get(tx_blocks, bnum)) {
+            assert(count < JOURNAL_CAPACITY);
+            targets[count++] = bnum;
+        }
+    }
+    char *images = malloc(JOURNAL_CAPACITY * BLOCK_SIZE);
+    assert(images);
+    for (int i = 0; i < count; ++i) {
+        memcpy(images + i * BLOCK_SIZE, blocks_peek_block(targets[i]), BLOCK_SIZE);
+        // from here on, only the checkpoint below writes it home
+        blocks_clean(targets[i]);
+        bitmap_put(tx_blocks, targets[i], 0);
+    }
+    __atomic_store_n(&tx_count, 0, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&update_lock);
+
+    // nothing to wait for, don't touch the disk
+    if (!__atomic_exchange_n(&data_written, 0, __ATOMIC_SEQ_CST) && count == 0) {
+        free(images);
+        return;
+    }
+
+    // the data written back for this transaction, and the last checkpoint,
+    // must be on disk before the journal is overwritten
+    blocks_barrier();
+    if (count > 0) {
+        journal_write(targets, images, count);
+        blocks_barrier();
+        for (int i = 0; i < count; ++i) {
+            blocks_write_through(targets[i], images + i * BLOCK_SIZE);
+        }
+    }
+    free(images);
+    printf("+ journal_commit() -> %d blocks, sequence %u\n", count, sequence);
+}
+
+// Make the running transaction and the data written back before it durable.
+// If a commit is already being written, waits for it and commits what came
+// after it together with everyone else who's waiting.
+void journal_commit() {
+    pthread_mutex_lock(&commit_lock);
+    unsigned long tid = running_tid;
+    while (committed_tid < tid) {
+        if (committing) {
+            pthread_cond_wait(&commit_done, &commit_lock);
+            continue;
+        }
+        committing = 1;
+        unsigned long closing = running_tid++;
+        pthread_mutex_unlock(&commit_lock);
+
+        commit_transaction();
+
+        pthread_mutex_lock(&commit_lock);
+        committed_tid = closing;
+        committing = 0;
+        pthread_cond_broadcast(&commit_done);
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+// Write back the given data blocks if they've changed.
+// Blocks that are part of the running transaction are left to the journal.
+void journal_write_data(const int *bnums, int count) {
+    int data[count + 1];
+    int data_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!bitmap_get(tx_blocks, bnums[i]) && blocks_dirty(bnums[i])) {
+            data[data_count++] = bnums[i];
+        }
+    }
+    if (data_count > 0) {
+        blocks_flush(data, data_count);
+        __atomic_store_n(&data_written, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Write back all data and commit.
+void journal_sync() {
+    int bnums[BLOCK_COUNT];
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        bnums[i] = i;
+    }
+    journal_write_data(bnums, BLOCK_COUNT);
+    journal_commit();
+}
+
+// Commit everything and empty the journal, on unmount.
+void journal_close() {
+    journal_sync();
+
+    // the transaction is home now, don't replay it over a newer image
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    blocks_write_through(JOURNAL_START, block);
+    blocks_barrier();
+    free(tx_blocks);
+    tx_blocks = NULL;
+}
+
+// Start an operation that changes the filesystem, once the running
+// transaction has room for whatever it changes.
+void journal_begin() {
+    pthread_mutex_lock(&credit_lock);
+    while (__atomic_load_n(&tx_count, __ATOMIC_SEQ_CST) + credits_held + JOURNAL_OP_CREDITS >
+           JOURNAL_OP_SPACE) {
+        if (credits_held == 0) {
+            // nothing in progress, committing empties the transaction
+            pthread_mutex_unlock(&credit_lock);
+            journal_commit();
+            pthread_mutex_lock(&credit_lock);
+        } else {
+            pthread_cond_wait(&credits_returned, &credit_lock);
+        }
+    }
+    credits_held += JOURNAL_OP_CREDITS;
+    pthread_mutex_unlock(&credit_lock);
+
+    pthread_rwlock_rdlock(&update_lock);
+}
+
+// End an operation, returning the room it reserved.
+void journal_end() {
+    pthread_rwlock_unlock(&update_lock);
+
+    pthread_mutex_lock(&credit_lock);
+    credits_held -= JOURNAL_OP_CREDITS;
+    pthread_cond_broadcast(&credits_returned);
+    pthread_mutex_unlock(&credit_lock);
+}
+
+// Is the block one of those that may be in every transaction?
+static int journal_shared(int bnum) {
+    return bnum == 0 || bnum >= JOURNAL_START + JOURNAL_BLOCKS;
+}
+
+// Add the metadata block to the running transaction.
+void journal_dirty(int bnum) {
+    if (bitmap_get(tx_blocks, bnum)) {
+        return;
+    }
+    uint8_t mask = 1 << (bnum % 8);
+    uint8_t old = __atomic_fetch_or(&tx_blocks[bnum / 8], mask, __ATOMIC_SEQ_CST);
+    if (!(old & mask) && !journal_shared(bnum)) {
+        int count = __atomic_add_fetch(&tx_count, 1, __ATOMIC_SEQ_CST);
+        // an operation changed more than JOURNAL_OP_CREDITS blocks
+        assert(count <= JOURNAL_OP_SPACE);
+    }
+}
+
+// Drop the block from the running transaction.
+void journal_forget(int bnum) {
+    if (!bitmap_get(tx_blocks, bnum)) {
+        return;
+    }
+    uint8_t mask = 1 << (bnum % 8);
+    uint8_t old = __atomic_fetch_and(&tx_blocks[bnum / 8], (uint8_t) ~mask, __ATOMIC_SEQ_CST);
+    if ((old & mask) && !journal_shared(bnum)) {
+        __atomic_sub_fetch(&tx_count, 1, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,60 @@
+// Write-ahead metadata journal.
+//
+// Blocks holding metadata (block 0 with the bitmaps and inode table, the
+// timestamp table, the dedup index, indirect blocks and directory blocks)
+// are changed through blocks_get_meta_block, which adds them to the running
+// transaction. Nothing of a transaction reaches its home location before
+// the whole transaction is on disk in the journal, so after a crash the
+// metadata is always as of some commit, never halfway through an operation.
+//
+// A commit copies the transaction's blocks, writes them to the journal
+// region with a header naming their home blocks and a checksum, waits for
+// that, then writes the copies to their homes. journal_init replays the
+// last transaction whose checksum matches, which is harmless if it already
+// made it home. File data isn't journaled: fsync writes back the file's
+// dirty data blocks before the commit that makes them reachable.
+//
+// Operations run between journal_begin and journal_end, so a commit never
+// sees half of one. Commits are batched: threads that fsync while a commit
+// is being written wait for it and then share the next one.
+//
+// A transaction always fits in the journal in one piece. Block 0, the
+// timestamps and the dedup index may be in every transaction; apart from
+// those, an operation changes at most JOURNAL_OP_CREDITS blocks (an inode's
+// indirect block, or a directory block and the directory's indirect block).
+// journal_begin reserves that much room, committing first, or waiting for
+// the operations in progress, if the running transaction has too little
+// left.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_BLOCKS 24 // header and block images
+#define JOURNAL_OP_CREDITS 3 // blocks an operation may add, see above
+#define JOURNAL_START (BLOCK_COUNT - 2 - JOURNAL_BLOCKS) // just before the timestamps
+#define JOURNAL_COMMIT_INTERVAL 5 // seconds
+
+// Replay the journal after the disk image is opened.
+void journal_init();
+// Commit everything and empty the journal, on unmount.
+void journal_close();
+
+// Start and end an operation that changes the filesystem.
+void journal_begin();
+void journal_end();
+
+// Add the metadata block to the running transaction.
+void journal_dirty(int bnum);
+// Drop the block from the running transaction, when it's freed.
+void journal_forget(int bnum);
+
+// Write back the given data blocks if they've changed,
+// ahead of the commit that makes them reachable.
+void journal_write_data(const int *bnums, int count);
+// Make the running transaction and the data written back before it durable.
+void journal_commit();
+// Write back all data and commit. storage.c's write-back thread calls it
+// every JOURNAL_COMMIT_INTERVAL seconds.
+void journal_sync();
+
+#endif
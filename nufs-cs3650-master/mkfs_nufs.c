@@ -0,0 +1,241 @@
+// Builds a nufs disk image from a directory tree on the host.
+//
+//   mkfs.nufs [-j threads] -d dir image
+//
+// The image is created from scratch. Directories and files are created in
+// sorted order, one directory level after the other, and every file gets
+// all of its blocks preallocated as soon as it's created, so each file is
+// stored in one run of consecutive blocks. The data is then copied in by
+// several threads at once: the blocks are already there, so writes to
+// different files don't allocate and don't get in each other's way. All the
+// metadata reaches the disk in a few big journal commits at the end.
+//
+// Only directories and regular files are copied; the image holds at most
+// BLOCK_COUNT blocks, so the tree has to fit in that.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "blocks.h"
+#include "storage.h"
+
+#define COPY_CHUNK (128 * 1024) // bytes read and written at a time
+
+// A regular file to copy into the image
+typedef struct build_file {
+    char *source; // path on the host
+    char *path; // path in the image
+    off_t size;
+    struct timespec times[2];
+} build_file_t;
+
+static build_file_t *files = NULL;
+static int file_count = 0;
+static int file_capacity = 0;
+static int next_file = 0; // next file for a thread to copy
+static int failed = 0;
+static long dir_count = 0;
+
+// Creates a file in the image and preallocates its blocks.
+static int build_file(const char *source, const char *path, const struct stat *st) {
+    int rv = storage_mknod(path, st->st_mode);
+    if (rv == 0 && st->st_size > 0) {
+        rv = storage_fallocate(path, 0, 0, st->st_size);
+    }
+    arena_reset();
+    if (rv < 0) {
+        fprintf(stderr, "%s: %s\n", source, strerror(-rv));
+        return -1;
+    }
+
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 64;
+        files = realloc(files, file_capacity * sizeof(build_file_t));
+    }
+    build_file_t *file = &files[file_count++];
+    file->source = strdup(source);
+    file->path = strdup(path);
+    file->size = st->st_size;
+    file->times[0] = st->st_atim;
+    file->times[1] = st->st_mtim;
+    return 0;
+}
+
+// Creates everything in the host directory source in the image directory
+// path, files first, then the subdirectories and what's in them.
+static int build_dir(const char *source, const char *path) {
+    struct dirent **entries;
+    int count = scandir(source, &entries, NULL, alphasort);
+    if (count < 0) {
+        perror(source);
+        return -1;
+    }
+
+    int rv = 0;
+    for (int pass = 0; pass < 2 && rv == 0; ++pass) {
+        for (int i = 0; i < count && rv == 0; ++i) {
+            const char *name = entries[i]->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            char child_source[PATH_MAX];
+            char child_path[PATH_MAX];
+            snprintf(child_source, PATH_MAX, "%s/%s", source, name);
+            snprintf(child_path, PATH_MAX, "%s/%s", strcmp(path, "/") ? path : "", name);
+
+            struct stat st;
+            if (lstat(child_source, &st) < 0) {
+                perror(child_source);
+                rv = -1;
+            } else if (pass == 0 && S_ISREG(st.st_mode)) {
+                rv = build_file(child_source, child_path, &st);
+            } else if (pass == 1 && S_ISDIR(st.st_mode)) {
+                rv = storage_mknod(child_path, st.st_mode);
+                arena_reset();
+                if (rv < 0) {
+                    fprintf(stderr, "%s: %s\n", child_source, strerror(-rv));
+                } else {
+                    dir_count++;
+                    rv = build_dir(child_source, child_path);
+                }
+            } else if (pass == 0 && !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "%s: skipped, not a regular file\n", child_source);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        free(entries[i]);
+    }
+    free(entries);
+    return rv;
+}
+
+// Copies a file's data into its preallocated blocks.
+static int copy_file(build_file_t *file, char *buf) {
+    int fd = open(file->source, O_RDONLY);
+    if (fd < 0) {
+        perror(file->source);
+        return -1;
+    }
+    int rv = 0;
+    off_t done = 0;
+    while (done < file->size && rv == 0) {
+        ssize_t got = pread(fd, buf, COPY_CHUNK, done);
+        if (got < 0) {
+            perror(file->source);
+            rv = -1;
+            break;
+        }
+        if (got == 0) {
+            // the file shrank since it was sized, what's left stays zeros
+            break;
+        }
+        if (done + got > file->size) {
+            got = file->size - done;
+        }
+        int wrote = storage_write(file->path, buf, got, done);
+        if (wrote != got) {
+            fprintf(stderr, "%s: %s\n", file->source, strerror(wrote < 0 ? -wrote : EIO));
+            rv = -1;
+        }
+        done += got;
+    }
+    close(fd);
+
+    storage_set_time(file->path, file->times);
+    arena_reset();
+    return rv;
+}
+
+// Takes files off the list and copies them until there are none left.
+static void *copy_thread(void *arg) {
+    (void) arg;
+    char *buf = malloc(COPY_CHUNK);
+    for (;;) {
+        int i = __atomic_fetch_add(&next_file, 1, __ATOMIC_SEQ_CST);
+        if (i >= file_count) {
+            break;
+        }
+        if (copy_file(&files[i], buf) < 0) {
+            __atomic_store_n(&failed, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: mkfs.nufs [-j threads] -d dir image\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *source = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "d:j:")) != -1) {
+        if (opt == 'd') {
+            source = optarg;
+        } else if (opt == 'j') {
+            threads = atoi(optarg);
+        } else {
+            usage();
+        }
+    }
+    if (source == NULL || argc - optind != 1 || threads < 1) {
+        usage();
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    // the image is made from scratch
+    blocks_remove(argv[optind]);
+    storage_init(argv[optind]);
+    storage_start_writeback();
+
+    int rv = build_dir(source, "/");
+    if (rv == 0) {
+        if (threads > file_count) {
+            threads = file_count ? file_count : 1;
+        }
+        pthread_t workers[threads];
+        for (int i = 0; i < threads; ++i) {
+            pthread_create(&workers[i], NULL, copy_thread, NULL);
+        }
+        for (int i = 0; i < threads; ++i) {
+            pthread_join(workers[i], NULL);
+        }
+        rv = failed ? -1 : 0;
+    }
+
+    struct statvfs vfs;
+    storage_statfs(&vfs);
+    storage_free();
+
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    off_t bytes = 0;
+    for (int i = 0; i < file_count; ++i) {
+        bytes += files[i].size;
+        free(files[i].source);
+        free(files[i].path);
+    }
+    free(files);
+    fprintf(stderr, "%s: %ld directories, %d files, %ld bytes, %ld of %ld blocks free, %.3f s\n",
+            argv[optind], dir_count, file_count, (long) bytes, (long) vfs.f_bfree,
+            (long) vfs.f_blocks, elapsed);
+    return rv < 0;
+}
@@ -11,6 +11,9 @@
 #include <assert.h>
 #include "storage.h"
 #include "inode.h"
+#include "nufs_ioctl.h"
+#include "arena.h"
+#include "trace.h"
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
@@ -18,30 +21,36 @@
 // Checks if a file exists.
 int nufs_access(const char *path, int mask)
 {
+    uint64_t start = trace_start();
     int rv = 0;
     rv = storage_access(path);
     printf("access(%s, %04o) -> %d\n", path, mask, rv);
+    trace_op(TRACE_ACCESS, path, NULL, 0, 0, mask, start, rv);
+    arena_reset();
     return rv;
 }
 
+// gets an object's attributes without ending the request,
+// so readdir can use it for every entry
+static int getattr_help(const char *path, struct stat *st)
+{
+    int rv = storage_stat(path, st);
+    st->st_uid = getuid();
+    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
+    if (rv < 0)
+        return rv;
+    return 0;
+}
+
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
 int nufs_getattr(const char *path, struct stat *st)
 {
-    int rv = 0;
-    if (strcmp(path, "/") == 0) { // Root metadata
-        st->st_mode = 040755;
-        st->st_size = 0;
-        st->st_uid = getuid();
-    }
-    else {
-        rv = storage_stat(path, st);
-        st->st_uid = getuid();
-    }
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
-    if (rv == -1)
-        return -ENOENT;
-    return 0;
+    uint64_t start = trace_start();
+    int rv = getattr_help(path, st);
+    trace_op(TRACE_GETATTR, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
+    return rv;
 }
 
 // implementation for: man 2 readdir
@@ -49,22 +58,27 @@ int nufs_getattr(const char *path, struct stat *st)
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi)
 {
+    (void) offset;
+    (void) fi;
+    uint64_t start = trace_start();
     struct stat st;
     int rv;
 
-    rv = nufs_getattr(path, &st);
+    rv = getattr_help(path, &st);
     assert(rv == 0);
 
     slist_t* dir_list = storage_list(path);
     filler(buf, ".", &st, 0);
     if (dir_list == NULL) {
         printf("readdir(%s) -> %d\n", path, rv);
+        trace_op(TRACE_READDIR, path, NULL, 0, 0, 0, start, 0);
+        arena_reset();
         return 0;
     }
 
     slist_t* cur = dir_list;
     while(cur) {
-        char current_path[strlen(path) + 50];
+        char current_path[strlen(path) + strlen(cur->data) + 2];
         strncpy(current_path, path, strlen(path));
         if (path[strlen(path)-1] == '/') {
             current_path[strlen(path)] = 0;
@@ -72,13 +86,15 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             current_path[strlen(path)] = '/';
             current_path[strlen(path) + 1] = 0;
         }
-        strncat(current_path, cur->data, 48);
-        nufs_getattr(current_path, &st);
+        strcat(current_path, cur->data);
+        getattr_help(current_path, &st);
         filler(buf, cur->data, &st, 0);
         cur = cur->next;
     }
 
     printf("readdir(%s) -> %d\n", path, rv);
+    trace_op(TRACE_READDIR, path, NULL, 0, 0, 0, start, 0);
+    arena_reset();
     return 0;
 }
 
@@ -86,9 +102,13 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // called for: man 2 open, man 2 link
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+    (void) rdev;
+    uint64_t start = trace_start();
     int rv;
     rv = storage_mknod(path, mode);
     printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+    trace_op(TRACE_MKNOD, path, NULL, 0, 0, mode, start, rv);
+    arena_reset();
     return rv;
 }
 
@@ -97,32 +117,45 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
+    uint64_t start = trace_start();
     int rv = storage_mknod(path, mode | 040000);
     printf("mkdir(%s) -> %d\n", path, rv);
+    trace_op(TRACE_MKDIR, path, NULL, 0, 0, mode, start, rv);
+    arena_reset();
     return rv;
 }
 
 int
 nufs_unlink(const char *path)
 {
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_unlink(path);
     printf("unlink(%s) -> %d\n", path, rv);
+    trace_op(TRACE_UNLINK, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
 int nufs_link(const char *from, const char *to)
 {
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_link(to, from);
     printf("link(%s => %s) -> %d\n", from, to, rv);
+    trace_op(TRACE_LINK, to, from, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
+// Not implemented.
 int nufs_rmdir(const char *path)
 {
-    int rv = -1;
+    uint64_t start = trace_start();
+    int rv = -ENOSYS;
     printf("rmdir(%s) -> %d\n", path, rv);
+    trace_op(TRACE_RMDIR, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
@@ -130,24 +163,48 @@ int nufs_rmdir(const char *path)
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to)
 {
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_rename(from, to);
     printf("rename(%s => %s) -> %d\n", from, to, rv);
+    trace_op(TRACE_RENAME, from, to, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
+// Not implemented.
 int nufs_chmod(const char *path, mode_t mode)
 {
-    int rv = -1;
+    uint64_t start = trace_start();
+    int rv = -ENOSYS;
     printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    trace_op(TRACE_CHMOD, path, NULL, 0, 0, mode, start, rv);
+    arena_reset();
     return rv;
 }
 
 int nufs_truncate(const char *path, off_t size)
 {
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_truncate(path, size);
     printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    trace_op(TRACE_TRUNCATE, path, NULL, 0, size, 0, start, rv);
+    arena_reset();
+    return rv;
+}
+
+// implements: man 2 fallocate
+// preallocates space for a file, or punches a hole in it
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi)
+{
+    (void) fi;
+    uint64_t start = trace_start();
+    int rv = storage_fallocate(path, mode, offset, length);
+    printf("fallocate(%s, %d, %ld bytes, @+%ld) -> %d\n", path, mode, length, offset, rv);
+    trace_op(TRACE_FALLOCATE, path, NULL, length, offset, mode, start, rv);
+    arena_reset();
     return rv;
 }
 
@@ -155,38 +212,96 @@ int nufs_truncate(const char *path, off_t size)
 // since FUSE doesn't assume you maintain state for
 // open files.
 // You can just check whether the file is accessible.
+// The kernel keeps the file's cached pages unless an ioctl changed its data
+// since it was last opened.
 int nufs_open(const char *path, struct fuse_file_info *fi)
 {
-    int rv = 0;
-    printf("open(%s) -> %d\n", path, rv);
+    uint64_t start = trace_start();
+    int rv = storage_open(path);
+    if (rv >= 0) {
+        fi->keep_cache = rv;
+        rv = 0;
+    }
+    printf("open(%s) -> %d {keep_cache: %d}\n", path, rv, fi->keep_cache);
+    trace_op(TRACE_OPEN, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    (void) fi;
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_read(path, buf, size, offset);
     printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    trace_op(TRACE_READ, path, NULL, size, offset, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    (void) fi;
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_write(path, buf, size, offset);
     printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    trace_op(TRACE_WRITE, path, NULL, size, offset, 0, start, rv);
+    arena_reset();
+    return rv;
+}
+
+// Called on every close of a file
+int nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void) fi;
+    uint64_t start = trace_start();
+    int rv = storage_flush(path);
+    printf("flush(%s) -> %d\n", path, rv);
+    trace_op(TRACE_FLUSH, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
+    return rv;
+}
+
+// implements: man 2 fsync
+// makes sure the file's data is on disk
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) fi;
+    uint64_t start = trace_start();
+    int rv = storage_fsync(path);
+    printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+    trace_op(TRACE_FSYNC, path, NULL, 0, 0, datasync, start, rv);
+    arena_reset();
+    return rv;
+}
+
+// implements: man 2 statfs
+// reports the free space and inodes
+int nufs_statfs(const char *path, struct statvfs *st)
+{
+    uint64_t start = trace_start();
+    int rv = storage_statfs(st);
+    printf("statfs(%s) -> %d {free: %ld of %ld blocks}\n",
+           path, rv, st->f_bfree, st->f_blocks);
+    trace_op(TRACE_STATFS, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    uint64_t start = trace_start();
     int rv = -1;
     rv = storage_set_time(path, ts);
     printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+    trace_op(TRACE_UTIMENS, path, NULL, 0, 0, 0, start, rv);
+    arena_reset();
     return rv;
 }
 
@@ -194,11 +309,100 @@ int nufs_utimens(const char* path, const struct timespec ts[2])
 int nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
+    (void) arg;
+    (void) fi;
+    (void) flags;
+    uint64_t start = trace_start();
     int rv = 0;
+    switch ((unsigned int) cmd) {
+    case NUFS_IOC_CLONE: {
+        nufs_clone_args_t *args = data;
+        args->src[NUFS_IOCTL_PATH_MAX - 1] = 0;
+        rv = storage_clone(args->src, path);
+        trace_op(TRACE_CLONE, path, args->src, 0, 0, 0, start, rv);
+        break;
+    }
+    case NUFS_IOC_COPY_RANGE: {
+        nufs_copy_range_args_t *args = data;
+        args->src[NUFS_IOCTL_PATH_MAX - 1] = 0;
+        if (args->src_offset < 0 || args->dst_offset < 0 || args->length < 0) {
+            rv = -EINVAL;
+        } else {
+            rv = storage_copy_range(args->src, args->src_offset,
+                                    path, args->dst_offset, args->length);
+        }
+        trace_op(TRACE_COPY_RANGE, path, args->src, args->length, args->dst_offset,
+                 args->src_offset, start, rv);
+        if (rv >= 0) {
+            args->length = rv;
+            rv = 0;
+        }
+        break;
+    }
+    case NUFS_IOC_SET_COMPRESSION: {
+        nufs_compression_args_t *args = data;
+        args->codec[sizeof(args->codec) - 1] = 0;
+        rv = storage_set_compression(path, args->codec);
+        trace_op(TRACE_SET_COMPRESSION, path, args->codec, 0, 0, 0, start, rv);
+        break;
+    }
+    case NUFS_IOC_GET_COMPRESSION: {
+        nufs_compression_args_t *args = data;
+        rv = storage_get_compression(path, args->codec);
+        trace_op(TRACE_GET_COMPRESSION, path, NULL, 0, 0, 0, start, rv);
+        break;
+    }
+    case NUFS_IOC_SET_DEDUP:
+        rv = storage_set_dedup(path, *(int *) data);
+        trace_op(TRACE_SET_DEDUP, path, NULL, 0, 0, *(int *) data, start, rv);
+        break;
+    case NUFS_IOC_GET_DEDUP:
+        rv = storage_get_dedup(path);
+        trace_op(TRACE_GET_DEDUP, path, NULL, 0, 0, 0, start, rv);
+        if (rv >= 0) {
+            *(int *) data = rv;
+            rv = 0;
+        }
+        break;
+    default:
+        rv = -ENOTTY;
+    }
     printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    arena_reset();
     return rv;
 }
 
+// Largest write the kernel should send us at once. Kernels before 4.20
+// can't send more than 32 pages per request anyway.
+#define NUFS_MAX_WRITE (128 * 1024)
+
+// Called when the filesystem is mounted, after fuse_main has gone into the
+// background. Asks the kernel to send writes of up to NUFS_MAX_WRITE bytes
+// instead of one page at a time, starts recording a trace if NUFS_TRACE is
+// set (see trace.h), and starts the write-back thread.
+void *nufs_init(struct fuse_conn_info *conn)
+{
+    trace_init();
+    storage_start_writeback();
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+    conn->max_write = NUFS_MAX_WRITE;
+    conn->max_readahead = NUFS_MAX_WRITE;
+    printf("init() {max_write: %u, big_writes: %d}\n",
+           conn->max_write, (conn->want & FUSE_CAP_BIG_WRITES) != 0);
+    return NULL;
+}
+
+// Called when the filesystem is unmounted.
+void nufs_destroy(void *private_data)
+{
+    (void) private_data;
+    trace_close();
+    storage_free();
+    printf("destroy()\n");
+}
+
 void nufs_init_ops(struct fuse_operations* ops)
 {
     memset(ops, 0, sizeof(struct fuse_operations));
@@ -214,19 +418,38 @@ void nufs_init_ops(struct fuse_operations* ops)
     ops->rename = nufs_rename;
     ops->chmod = nufs_chmod;
     ops->truncate = nufs_truncate;
+    ops->fallocate = nufs_fallocate;
     ops->open = nufs_open;
     ops->read = nufs_read;
     ops->write = nufs_write;
+    ops->flush = nufs_flush;
+    ops->fsync = nufs_fsync;
+    ops->statfs = nufs_statfs;
     ops->utimens = nufs_utimens;
     ops->ioctl = nufs_ioctl;
+    ops->init = nufs_init;
+    ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// How long the kernel may cache attributes, names and failed lookups,
+// in seconds. Names only change through the kernel, which keeps its cache
+// of them up to date itself, so that can be long. The ioctls change a
+// file's size behind the kernel's back, and this API has no way to tell it,
+// so attributes aren't cached; getattr is cheap, it never reads the disk.
+// Passing the options on the command line overrides them.
+#define DEFAULT_CACHE_OPTIONS "-oattr_timeout=0,entry_timeout=30,negative_timeout=5"
+
 int main(int argc, char *argv[])
 {
     assert(argc > 2 && argc < 6);
     storage_init(argv[--argc]);
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    fuse_opt_insert_arg(&args, 1, DEFAULT_CACHE_OPTIONS);
+    int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return rv;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+// ioctl commands understood by nufs_ioctl.
+//
+// FUSE only forwards ioctls whose argument size is encoded in the command,
+// so paths are passed inline and are relative to the mount point
+// (e.g. "/dir/file.txt").
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_IOCTL_PATH_MAX 256
+
+// Makes the file the ioctl is called on share all of src's blocks.
+// Same idea as FICLONE, but FICLONE passes a file descriptor which
+// means nothing on our side of FUSE.
+typedef struct nufs_clone_args {
+    char src[NUFS_IOCTL_PATH_MAX];
+} nufs_clone_args_t;
+
+// Copies length bytes from src into the file the ioctl is called on,
+// sharing whole blocks where the offsets line up (like copy_file_range).
+// length is updated with the number of bytes actually copied.
+typedef struct nufs_copy_range_args {
+    char src[NUFS_IOCTL_PATH_MAX];
+    int64_t src_offset;
+    int64_t dst_offset;
+    int64_t length;
+} nufs_copy_range_args_t;
+
+// Sets (or gets) the compression policy of the file the ioctl is called on.
+// codec is the name of a codec from compress.c, or "none".
+typedef struct nufs_compression_args {
+    char codec[16];
+} nufs_compression_args_t;
+
+// NUFS_IOC_SET_DEDUP and NUFS_IOC_GET_DEDUP take an int,
+// non-zero if identical blocks of the file should be shared.
+
+#define NUFS_IOC_CLONE _IOW('N', 1, nufs_clone_args_t)
+#define NUFS_IOC_COPY_RANGE _IOWR('N', 2, nufs_copy_range_args_t)
+#define NUFS_IOC_SET_COMPRESSION _IOW('N', 3, nufs_compression_args_t)
+#define NUFS_IOC_GET_COMPRESSION _IOR('N', 4, nufs_compression_args_t)
+#define NUFS_IOC_SET_DEDUP _IOW('N', 5, int)
+#define NUFS_IOC_GET_DEDUP _IOR('N', 6, int)
+
+#endif
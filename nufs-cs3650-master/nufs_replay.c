@@ -0,0 +1,430 @@
+// Replays a trace recorded with NUFS_TRACE (see trace.h).
+//
+//   nufs_replay [-p] trace image
+//   nufs_replay [-p] -m trace mountpoint
+//
+// The operations are replayed one at a time in the order they were recorded,
+// either straight through the storage_* API on the given disk image, or
+// through the kernel against a mounted nufs with -m. They go as fast as
+// possible, or with -p at the pace they were recorded at. Afterwards the
+// number of operations, their latency and how many of them got a different
+// result than when they were recorded are reported per operation.
+//
+// Traces don't hold file contents, so writes use pseudo-random bytes. They
+// won't compress or deduplicate like the recorded data did.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "nufs_ioctl.h"
+#include "storage.h"
+#include "trace.h"
+
+#define OPEN_FILES 64 // files kept open at once in mount mode
+
+// Totals for one kind of operation
+typedef struct op_stats {
+    long count;
+    long mismatches; // result differs from the recorded one
+    uint64_t replay_us;
+    uint64_t recorded_us;
+} op_stats_t;
+
+// A file kept open between operations in mount mode
+typedef struct open_file {
+    char *path;
+    int fd;
+} open_file_t;
+
+static const char *mount_point = NULL; // mount mode if set
+static open_file_t open_files[OPEN_FILES];
+static int next_victim = 0; // slot to reuse once they're all taken
+static char *data = NULL; // buffer for reads and writes
+static uint32_t data_size = 0;
+
+// Gets the monotonic time in microseconds.
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Waits until the given monotonic time in microseconds.
+static void sleep_until(uint64_t us) {
+    struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Makes the data buffer at least size bytes.
+static void data_reserve(uint32_t size) {
+    if (size > data_size) {
+        data = realloc(data, size);
+        data_size = size;
+    }
+}
+
+// Fills the data buffer with size pseudo-random bytes that only depend on
+// the offset, so replays are repeatable.
+static void data_fill(uint32_t size, int64_t offset) {
+    data_reserve(size);
+    uint64_t x = offset * 0x9e3779b97f4a7c15ull + 1;
+    for (uint32_t i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = x;
+    }
+}
+
+// Replays an operation through the storage API. Returns what the nufs.c
+// callback would have.
+static int replay_storage(const trace_record_t *rec, const char *path, const char *path2) {
+    struct stat st;
+    struct statvfs vfs;
+    nufs_compression_args_t codec;
+    struct timespec now[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
+    int rv;
+
+    switch (rec->op) {
+    case TRACE_ACCESS:
+        return storage_access(path);
+    case TRACE_GETATTR:
+        return storage_stat(path, &st);
+    case TRACE_READDIR:
+        storage_list(path);
+        return 0;
+    case TRACE_MKNOD:
+        return storage_mknod(path, rec->arg);
+    case TRACE_MKDIR:
+        return storage_mknod(path, rec->arg | 040000);
+    case TRACE_LINK:
+        return storage_link(path, path2);
+    case TRACE_UNLINK:
+        return storage_unlink(path);
+    case TRACE_RENAME:
+        return storage_rename(path, path2);
+    case TRACE_TRUNCATE:
+        return storage_truncate(path, rec->offset);
+    case TRACE_FALLOCATE:
+        return storage_fallocate(path, rec->arg, rec->offset, rec->size);
+    case TRACE_OPEN:
+        rv = storage_open(path);
+        return rv < 0 ? rv : 0;
+    case TRACE_READ:
+        data_reserve(rec->size);
+        return storage_read(path, data, rec->size, rec->offset);
+    case TRACE_WRITE:
+        data_fill(rec->size, rec->offset);
+        return storage_write(path, data, rec->size, rec->offset);
+    case TRACE_FLUSH:
+        return storage_flush(path);
+    case TRACE_FSYNC:
+        return storage_fsync(path);
+    case TRACE_STATFS:
+        return storage_statfs(&vfs);
+    case TRACE_UTIMENS:
+        return storage_set_time(path, now);
+    case TRACE_CLONE:
+        return storage_clone(path2, path);
+    case TRACE_COPY_RANGE:
+        // the checks nufs_ioctl makes first; the length is recorded in 32 bits
+        if (rec->offset < 0 || rec->arg < 0 || (int32_t) rec->size < 0) {
+            return -EINVAL;
+        }
+        rv = storage_copy_range(path2, rec->arg, path, rec->offset, rec->size);
+        return rv < 0 ? rv : 0;
+    case TRACE_SET_COMPRESSION:
+        return storage_set_compression(path, path2);
+    case TRACE_GET_COMPRESSION:
+        return storage_get_compression(path, codec.codec);
+    case TRACE_SET_DEDUP:
+        return storage_set_dedup(path, rec->arg);
+    case TRACE_GET_DEDUP:
+        rv = storage_get_dedup(path);
+        return rv < 0 ? rv : 0;
+    default:
+        // rmdir and chmod aren't implemented by nufs
+        return -ENOSYS;
+    }
+}
+
+// Gets the path under the mount point.
+static char *mounted(const char *path, char *buf) {
+    snprintf(buf, PATH_MAX, "%s%s", mount_point, path);
+    return buf;
+}
+
+// Gets a descriptor for the file, opening it if it isn't open yet.
+// Once every slot is taken, the slots are closed and reused in turn.
+static int file_fd(const char *path) {
+    char full[PATH_MAX];
+    int slot = -1;
+    for (int i = 0; i < OPEN_FILES; ++i) {
+        if (open_files[i].path && strcmp(open_files[i].path, path) == 0) {
+            return open_files[i].fd;
+        }
+        if (open_files[i].path == NULL && slot < 0) {
+            slot = i;
+        }
+    }
+    int fd = open(mounted(path, full), O_RDWR);
+    if (fd < 0) {
+        return fd;
+    }
+    if (slot < 0) {
+        slot = next_victim;
+        next_victim = (next_victim + 1) % OPEN_FILES;
+        close(open_files[slot].fd);
+        free(open_files[slot].path);
+    }
+    open_files[slot].path = strdup(path);
+    open_files[slot].fd = fd;
+    return fd;
+}
+
+// Closes the file if it's open.
+static int file_close(const char *path) {
+    for (int i = 0; i < OPEN_FILES; ++i) {
+        if (open_files[i].path && strcmp(open_files[i].path, path) == 0) {
+            int rv = close(open_files[i].fd);
+            free(open_files[i].path);
+            open_files[i].path = NULL;
+            return rv;
+        }
+    }
+    return 0;
+}
+
+// Replays an operation with system calls on the mounted filesystem.
+// Returns 0 or -errno. The kernel caches some things and turns some
+// calls into several operations, so results can differ more than
+// when replaying through the storage API.
+static int replay_mount(const trace_record_t *rec, const char *path, const char *path2) {
+    char full[PATH_MAX];
+    char full2[PATH_MAX];
+    struct stat st;
+    struct statvfs vfs;
+    long rv;
+
+    switch (rec->op) {
+    case TRACE_ACCESS:
+        rv = access(mounted(path, full), rec->arg);
+        break;
+    case TRACE_GETATTR:
+        rv = stat(mounted(path, full), &st);
+        break;
+    case TRACE_READDIR: {
+        DIR *dir = opendir(mounted(path, full));
+        rv = dir ? 0 : -1;
+        while (dir && readdir(dir)) {
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        break;
+    }
+    case TRACE_MKNOD:
+        rv = mknod(mounted(path, full), rec->arg, 0);
+        break;
+    case TRACE_MKDIR:
+        rv = mkdir(mounted(path, full), rec->arg);
+        break;
+    case TRACE_LINK:
+        rv = link(mounted(path2, full2), mounted(path, full));
+        break;
+    case TRACE_UNLINK:
+        rv = unlink(mounted(path, full));
+        break;
+    case TRACE_RMDIR:
+        rv = rmdir(mounted(path, full));
+        break;
+    case TRACE_RENAME:
+        rv = rename(mounted(path, full), mounted(path2, full2));
+        break;
+    case TRACE_CHMOD:
+        rv = chmod(mounted(path, full), rec->arg);
+        break;
+    case TRACE_TRUNCATE:
+        rv = truncate(mounted(path, full), rec->offset);
+        break;
+    case TRACE_FALLOCATE:
+        rv = fallocate(file_fd(path), rec->arg, rec->offset, rec->size);
+        break;
+    case TRACE_OPEN:
+        rv = file_fd(path) < 0 ? -1 : 0;
+        break;
+    case TRACE_READ:
+        data_reserve(rec->size);
+        rv = pread(file_fd(path), data, rec->size, rec->offset);
+        break;
+    case TRACE_WRITE:
+        data_fill(rec->size, rec->offset);
+        rv = pwrite(file_fd(path), data, rec->size, rec->offset);
+        break;
+    case TRACE_FLUSH:
+        rv = file_close(path);
+        break;
+    case TRACE_FSYNC:
+        rv = rec->arg ? fdatasync(file_fd(path)) : fsync(file_fd(path));
+        break;
+    case TRACE_STATFS:
+        rv = statvfs(mounted(path, full), &vfs);
+        break;
+    case TRACE_UTIMENS:
+        rv = utimensat(AT_FDCWD, mounted(path, full), NULL, 0);
+        break;
+    case TRACE_CLONE: {
+        nufs_clone_args_t args;
+        memset(&args, 0, sizeof(args));
+        strncpy(args.src, path2, NUFS_IOCTL_PATH_MAX - 1);
+        rv = ioctl(file_fd(path), NUFS_IOC_CLONE, &args);
+        break;
+    }
+    case TRACE_COPY_RANGE: {
+        nufs_copy_range_args_t args;
+        memset(&args, 0, sizeof(args));
+        strncpy(args.src, path2, NUFS_IOCTL_PATH_MAX - 1);
+        args.src_offset = rec->arg;
+        args.dst_offset = rec->offset;
+        args.length = rec->size;
+        rv = ioctl(file_fd(path), NUFS_IOC_COPY_RANGE, &args);
+        break;
+    }
+    case TRACE_SET_COMPRESSION:
+    case TRACE_GET_COMPRESSION: {
+        nufs_compression_args_t args;
+        memset(&args, 0, sizeof(args));
+        strncpy(args.codec, path2, sizeof(args.codec) - 1);
+        rv = ioctl(file_fd(path), rec->op == TRACE_SET_COMPRESSION ?
+                                  NUFS_IOC_SET_COMPRESSION : NUFS_IOC_GET_COMPRESSION, &args);
+        break;
+    }
+    case TRACE_SET_DEDUP:
+    case TRACE_GET_DEDUP: {
+        int on = rec->arg;
+        rv = ioctl(file_fd(path), rec->op == TRACE_SET_DEDUP ?
+                                  NUFS_IOC_SET_DEDUP : NUFS_IOC_GET_DEDUP, &on);
+        break;
+    }
+    default:
+        rv = -1;
+        errno = ENOSYS;
+    }
+    return rv < 0 ? -errno : rv;
+}
+
+// Prints the totals for every kind of operation that was replayed.
+static void report(op_stats_t *stats, long ops, uint64_t elapsed_us) {
+    printf("%-16s %8s %12s %12s %10s\n", "op", "count", "replay us", "recorded us", "mismatch");
+    for (int op = 1; op < TRACE_OPS; ++op) {
+        op_stats_t *s = &stats[op];
+        if (s->count) {
+            printf("%-16s %8ld %12.1f %12.1f %10ld\n", trace_op_name(op), s->count,
+                   (double) s->replay_us / s->count, (double) s->recorded_us / s->count,
+                   s->mismatches);
+        }
+    }
+    printf("%ld operations in %.3f s, %.0f ops/s\n", ops, elapsed_us / 1e6,
+           elapsed_us ? ops * 1e6 / elapsed_us : 0.0);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: nufs_replay [-p] trace image\n"
+                    "       nufs_replay [-p] -m trace mountpoint\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int paced = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "pm")) != -1) {
+        if (opt == 'p') {
+            paced = 1;
+        } else if (opt == 'm') {
+            mount_point = "";
+        } else {
+            usage();
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+
+    FILE *file = fopen(argv[optind], "r");
+    trace_header_t hdr;
+    if (file == NULL || trace_read_header(file, &hdr) < 0) {
+        fprintf(stderr, "%s: not a nufs trace\n", argv[optind]);
+        return 1;
+    }
+    if (mount_point) {
+        mount_point = argv[optind + 1];
+    } else {
+        storage_init(argv[optind + 1]);
+        storage_start_writeback();
+    }
+
+    op_stats_t stats[TRACE_OPS];
+    memset(stats, 0, sizeof(stats));
+    trace_record_t rec;
+    char path[PATH_MAX];
+    char path2[PATH_MAX];
+    long ops = 0;
+    uint64_t trace_start_us = 0;
+    uint64_t replay_start = now_us();
+    int rv;
+    while ((rv = trace_read(file, &rec, path, path2, PATH_MAX)) > 0) {
+        if (ops == 0) {
+            trace_start_us = rec.start_us;
+        }
+        if (paced && rec.start_us > trace_start_us) {
+            sleep_until(replay_start + (rec.start_us - trace_start_us));
+        }
+
+        uint64_t start = now_us();
+        int result = mount_point ? replay_mount(&rec, path, path2)
+                                 : replay_storage(&rec, path, path2);
+        uint64_t latency = now_us() - start;
+        arena_reset();
+
+        if (rec.op > 0 && rec.op < TRACE_OPS) {
+            op_stats_t *s = &stats[rec.op];
+            s->count++;
+            s->replay_us += latency;
+            s->recorded_us += rec.latency_us;
+            s->mismatches += result != rec.result;
+        }
+        ops++;
+    }
+    uint64_t elapsed = now_us() - replay_start;
+    if (rv < 0) {
+        fprintf(stderr, "%s: truncated after %ld operations\n", argv[optind], ops);
+    }
+
+    if (mount_point) {
+        for (int i = 0; i < OPEN_FILES; ++i) {
+            if (open_files[i].path) {
+                file_close(open_files[i].path);
+            }
+        }
+    } else {
+        storage_free();
+    }
+    fclose(file);
+    free(data);
+    report(stats, ops, elapsed);
+    return rv < 0;
+}
@@ -0,0 +1,38 @@
+// Implementation of path.h
+
+#include <string.h>
+
+#include "path.h"
+
+// Start iterating over the components of the first len bytes of path.
+void path_iter_init(path_iter_t *it, const char *path, int len) {
+    it->pos = path;
+    it->end = path + len;
+}
+
+// Get the next component of the path, skipping empty ones.
+int path_next(path_iter_t *it, const char **name) {
+    while (it->pos < it->end && *it->pos == '/') {
+        it->pos++;
+    }
+    if (it->pos == it->end) {
+        return -1;
+    }
+
+    *name = it->pos;
+    while (it->pos < it->end && *it->pos != '/') {
+        it->pos++;
+    }
+    return it->pos - *name;
+}
+
+// Split a path into its parent directory and its last component.
+int path_split(const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        *name = path;
+        return 0;
+    }
+    *name = slash + 1;
+    return slash - path;
+}
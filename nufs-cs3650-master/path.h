@@ -0,0 +1,23 @@
+// Walking paths in place, without copying their components.
+
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_iter {
+    const char *pos; // start of the rest of the path
+    const char *end;
+} path_iter_t;
+
+// Start iterating over the components of the first len bytes of path.
+void path_iter_init(path_iter_t *it, const char *path, int len);
+
+// Get the next component of the path, skipping empty ones.
+// Points name into the path and returns the component's length,
+// or returns -1 when there are no components left.
+int path_next(path_iter_t *it, const char **name);
+
+// Split a path into its parent directory and its last component.
+// Returns the length of the parent part and points name at the last component.
+int path_split(const char *path, const char **name);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <alloca.h>
 
+#include "arena.h"
 #include "slist.h"
 
 slist_t*
@@ -16,6 +17,22 @@ s_cons(const char* text, slist_t* rest)
     return xs;
 }
 
+slist_t*
+s_cons_arena(const char* text, slist_t* rest)
+{
+    return s_cons_arena_len(text, strlen(text), rest);
+}
+
+slist_t*
+s_cons_arena_len(const char* text, size_t len, slist_t* rest)
+{
+    slist_t* xs = arena_alloc(sizeof(slist_t));
+    xs->data = arena_strndup(text, len);
+    xs->refs = 1;
+    xs->next = rest;
+    return xs;
+}
+
 void
 s_free(slist_t* xs)
 {
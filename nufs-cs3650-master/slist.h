@@ -3,16 +3,24 @@
 #ifndef SLIST_H
 #define SLIST_H
 
+#include <stddef.h>
+
 // Used for directory listings and manipulating paths
 typedef struct slist {
     char* data;
     int   refs;
-    struct slist_t* next;
+    struct slist* next;
 } slist_t;
 
 // Cons a string to a string list.
 slist_t *s_cons(const char *text, slist_t *rest);
 
+// Cons a string to a string list, allocating from the request arena.
+// Lists built this way must not be passed to s_free.
+slist_t *s_cons_arena(const char *text, slist_t *rest);
+// Same, but only takes the first len characters of text.
+slist_t *s_cons_arena_len(const char *text, size_t len, slist_t *rest);
+
 // Free the given string list.
 void s_free(slist_t *xs);
 
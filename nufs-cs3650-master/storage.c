@@ -1,6 +1,10 @@
 // implementation of storage.h
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <errno.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,60 +13,195 @@
 #include "directory.h"
 #include "inode.h"
 #include "bitmap.h"
-
-#define NAME_SIZE 50
+#include "compress.h"
+#include "dedup.h"
+#include "path.h"
+#include "timestamps.h"
+#include "journal.h"
 
 // These are helper methods for storage_read and storage_write.
 // They do the actual reading and writing from the buffers.
-void write_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf);
+int write_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf);
+
+void read_help(int first_i, int second_i, int remainder, const inode_t *node, const char *buf);
 
-void read_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf);
+// Per-inode data versions, kept in memory only. A file's version is bumped
+// whenever its data changes behind the kernel's back (through an ioctl),
+// and storage_open compares it to the version the kernel saw when the file
+// was last opened, to tell whether the kernel's cached pages are still good.
+static unsigned int *data_versions = NULL;
+static unsigned int *kernel_versions = NULL;
+
+// Notes that the file's data changed without going through the kernel.
+static void storage_invalidate(int inum) {
+    __atomic_add_fetch(&data_versions[inum], 1, __ATOMIC_SEQ_CST);
+}
+
+// The write-back thread commits the journal and writes back dirty data
+// every JOURNAL_COMMIT_INTERVAL seconds, whether or not anything else is
+// going on, so a crash loses at most that much of what wasn't fsynced.
+// It also writes cached timestamps to their table once they're due.
+static pthread_t writeback_thread;
+static int writeback_started = 0;
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_wake = PTHREAD_COND_INITIALIZER;
+static int writeback_stop = 0;
+
+// Body of the write-back thread. Runs until storage_free stops it.
+static void *writeback_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&writeback_lock);
+    while (!writeback_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += JOURNAL_COMMIT_INTERVAL;
+        while (!writeback_stop &&
+               pthread_cond_timedwait(&writeback_wake, &writeback_lock, &until) != ETIMEDOUT) {
+        }
+        if (writeback_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&writeback_lock);
+        journal_begin();
+        times_flush_due();
+        journal_end();
+        journal_sync();
+        pthread_mutex_lock(&writeback_lock);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return NULL;
+}
 
 // initialize our basic file structure
 void storage_init(const char *path) {
     blocks_init(path);
-    if (!bitmap_get(get_blocks_bitmap(), 4)) {
+    journal_init();
+    blocks_check_format();
+    int bad = inode_find_bad_block();
+    if (bad >= 0) {
+        fprintf(stderr, "nufs: %s: inode %d uses a reserved block or one outside the image\n", path, bad);
+        exit(1);
+    }
+    // a new image gets its root directory as the first inode
+    if (!bitmap_get(peek_inode_bitmap(), 0)) {
         directory_init();
     }
+
+    // the kernel starts out with nothing cached
+    data_versions = calloc(inode_count(), sizeof(unsigned int));
+    kernel_versions = calloc(inode_count(), sizeof(unsigned int));
+    for (int i = 0; i < inode_count(); ++i) {
+        data_versions[i] = 1;
+    }
+}
+
+// Starts the write-back thread. It's separate from storage_init because
+// threads don't survive a fork: nufs starts it once fuse_main has gone
+// into the background, the tools right after storage_init.
+void storage_start_writeback() {
+    writeback_stop = 0;
+    if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) == 0) {
+        writeback_started = 1;
+    }
+}
+
+// write everything back and close the disk image
+void storage_free() {
+    if (writeback_started) {
+        pthread_mutex_lock(&writeback_lock);
+        writeback_stop = 1;
+        pthread_cond_signal(&writeback_wake);
+        pthread_mutex_unlock(&writeback_lock);
+        pthread_join(writeback_thread, NULL);
+        writeback_started = 0;
+    }
+
+    times_close();
+    journal_close();
+    blocks_free();
+    free(data_versions);
+    free(kernel_versions);
+}
+
+// Opens the file at the given path. Returns 1 if the kernel may keep the
+// pages it cached the last time the file was open, 0 if it has to drop them,
+// or -ENOENT or -ENOTDIR.
+int storage_open(const char *path) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    unsigned int version = __atomic_load_n(&data_versions[inum], __ATOMIC_SEQ_CST);
+    unsigned int seen = __atomic_exchange_n(&kernel_versions[inum], version, __ATOMIC_SEQ_CST);
+    return seen == version;
 }
 
-// check to see if the file is available, if not returns -1
+// check to see if the file is available, if not returns -ENOENT or -ENOTDIR
 int storage_access(const char *path) {
-    if (tree_lookup(path) >= 0) {
-        return 0;
-    } else
-        return -1;
+    int inum = tree_lookup(path);
+    return inum < 0 ? inum : 0;
 }
 
 // Changes the stats to the file stats.
-int storage_stat(const char *path, struct stat *st) {
+static int stat_help(const char *path, struct stat *st) {
     int inum = tree_lookup(path);
-    if (inum > 0) {
-        inode_t *node = get_inode(inum);
+    if (inum >= 0) {
+        const inode_t *node = peek_inode(inum);
         st->st_nlink = node->refs;
         st->st_mode = node->mode;
         st->st_size = node->size;
+        times_get(inum, st);
         return 0;
     } else {
-        return -1;
+        return inum;
+    }
+}
+
+// Stats as one journal operation, since loading the times into the cache
+// may write another inode's times to the table, see stat_help.
+int storage_stat(const char *path, struct stat *st) {
+    journal_begin();
+    int rv = stat_help(path, st);
+    journal_end();
+    return rv;
+}
+
+// Changes the size of the given file. Bytes past the old end read as zeros.
+static int truncate_help(int inum, inode_t *node, off_t size) {
+    if (size > INODE_MAX_SIZE) {
+        return -EFBIG;
+    }
+    compress_forget(inum);
+    int rv;
+    if (node->size > size && (node->flags & INODE_PACKED)) {
+        rv = compress_truncate(inum, node, size);
+    } else if (node->size > size) {
+        rv = shrink_inode(node, size);
+    } else {
+        rv = grow_inode(node, size);
     }
+    times_touch(inum, TOUCH_MTIME | TOUCH_CTIME);
+    return rv < 0 ? -ENOSPC : 0;
 }
 
 // Truncates the file at the given path to the given size.
 int storage_truncate(const char *path, off_t size) {
+    journal_begin();
     int inum = tree_lookup(path);
-    inode_t *node = get_inode(inum);
-    if (node->size > size) {
-        shrink_inode(node, size);
-    } else {
-        grow_inode(node, size);
-    }
-    return 0;
+    int rv = inum < 0 ? inum : truncate_help(inum, get_inode(inum), size);
+    journal_end();
+    return rv;
 }
 
-void write_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf) {
+// Pages shared with a clone are copied before they're written to,
+// so this returns -1 if there's no space left for the copy.
+int write_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf) {
     while (remainder > 0) {
-        char *dest = blocks_get_block(inode_get_pnum(node, second_i));
+        int pnum = inode_unshare_pnum(node, second_i);
+        if (pnum < 0) {
+            return -1;
+        }
+        char *dest = blocks_get_block(pnum);
         dest += second_i % 4096;
         int size;
         if (remainder < 4096 - (second_i % 4096)) {
@@ -76,93 +215,643 @@ void write_help(int first_i, int second_i, int remainder, inode_t *node, const c
         second_i += size;
         remainder -= size;
     }
-
+    return 0;
 }
 
-void read_help(int first_i, int second_i, int remainder, inode_t *node, const char *buf) {
+// Holes and preallocated pages read as zeros.
+void read_help(int first_i, int second_i, int remainder, const inode_t *node, const char *buf) {
     while (remainder > 0) {
-        char *src = blocks_get_block(inode_get_pnum(node, second_i));
-        src += second_i % 4096;
+        int pnum = inode_get_pnum(node, second_i);
         int size;
         if (remainder < 4096 - (second_i % 4096)) {
             size = remainder;
         } else {
             size = 4096 - (second_i % 4096);
         }
-        memcpy(buf + first_i, src, size);
+        if (pnum && !block_unwritten(pnum)) {
+            const char *src = blocks_peek_block(pnum);
+            src += second_i % 4096;
+            memcpy((char *) buf + first_i, src, size);
+        } else {
+            memset((char *) buf + first_i, 0, size);
+        }
         first_i += size;
         second_i += size;
         remainder -= size;
     }
 }
 
+// Files that have compressed clusters (or want them) go through compress.c,
+// deduplicated files go through dedup.c on the way in,
+// everything else goes straight to the blocks.
+static int file_compressed(const inode_t *node) {
+    return node->flags & (INODE_COMPRESS | INODE_PACKED);
+}
+
+static int file_read(int inum, const inode_t *node, char *buf, int size, int offset) {
+    if (file_compressed(node)) {
+        return compress_read(inum, node, buf, size, offset);
+    }
+    read_help(0, offset, size, node, buf);
+    return size;
+}
+
+static int file_write(int inum, inode_t *node, const char *buf, int size, int offset) {
+    if (file_compressed(node)) {
+        return compress_write(inum, node, buf, size, offset);
+    }
+    if (node->flags & INODE_DEDUP) {
+        return dedup_write(node, buf, size, offset);
+    }
+    return write_help(0, offset, size, node, buf) < 0 ? -1 : size;
+}
+
 // Writes to the path from the buf. Returns the size of the data written
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-    inode_t *node = get_inode(tree_lookup(path));
+// Writes may start past the end of the file, leaving a hole before them.
+// If there's no space for all of it, the file keeps its old size.
+static int path_write_help(const char *path, const char *buf, size_t size, off_t offset) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    if (offset + (off_t) size > INODE_MAX_SIZE) {
+        return -EFBIG;
+    }
+    inode_t *node = get_inode(inum);
+    int old_size = node->size;
     // Make sure size is valid
-    if (node->size < size + offset) {
-        storage_truncate(path, size + offset);
+    if (node->size < offset + (off_t) size) {
+        truncate_help(inum, node, offset + size);
     }
-    write_help(0, offset, size, node, buf);
+    if (file_write(inum, node, buf, size, offset) < 0) {
+        if (node->size > old_size) {
+            truncate_help(inum, node, old_size);
+        }
+        return -ENOSPC;
+    }
+    times_touch(inum, TOUCH_MTIME | TOUCH_CTIME);
     return size;
 }
 
+// Writes as one journal operation, see path_write_help.
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    journal_begin();
+    int rv = path_write_help(path, buf, size, offset);
+    journal_end();
+    return rv;
+}
+
 
 // Reads from the file at the given path. Returns the size of the data read.
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-    inode_t *node = get_inode(tree_lookup(path));
-    read_help(0, offset, size, node, buf);
+static int path_read_help(const char *path, char *buf, size_t size, off_t offset) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    const inode_t *node = peek_inode(inum);
+    if (offset >= node->size) {
+        return 0;
+    }
+    if ((off_t) size > node->size - offset) {
+        size = node->size - offset;
+    }
+    if (file_read(inum, node, buf, size, offset) < 0) {
+        return -EIO;
+    }
+    times_touch(inum, TOUCH_ATIME);
     return size;
 }
 
+// Reads as one journal operation, since making room in the timestamp cache
+// may write to the table. The read itself changes nothing, see
+// path_read_help.
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+    journal_begin();
+    int rv = path_read_help(path, buf, size, offset);
+    journal_end();
+    return rv;
+}
 
-// Add a directory at the current path
-int storage_mknod(const char *path, int mode) {
-    size_t path_len = strlen(path);
-    char *item = malloc(NAME_SIZE);
-    char *parent = malloc(path_len);
 
-    slist_t *file_list = s_explode(path, '/');
-    slist_t *dir_list = file_list;
+// Finds the directory the last component of the path goes in, and points
+// *item at that component. Returns the directory's inum, or -errno.
+static int parent_lookup(const char *path, const char **item) {
+    int parent_len = path_split(path, item);
+    int parent = tree_lookup_len(path, parent_len);
+    if (parent < 0) {
+        return parent;
+    }
+    if (!S_ISDIR(peek_inode(parent)->mode)) {
+        return -ENOTDIR;
+    }
+    if (strlen(*item) >= DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    return parent;
+}
 
-    parent[0] = 0;
-    while (dir_list->next) {
-        strncat(parent, "/", 1);
-        strncat(parent, dir_list->data, DIR_NAME_LENGTH);
-        dir_list = dir_list->next;
+// Add a directory at the current path
+static int mknod_help(const char *path, int mode) {
+    const char *item;
+    int parent = parent_lookup(path, &item);
+    if (parent < 0) {
+        return parent;
     }
-    size_t dir_list_len = strlen(dir_list->data);
-    memcpy(item, dir_list->data, dir_list_len);
-    item[dir_list_len] = 0;
 
-    int new_inode = alloc_inode();
+    int new_inode = alloc_inode_near(parent, mode);
+    if (new_inode < 0) {
+        return -ENOSPC;
+    }
     inode_t *node = get_inode(new_inode);
     node->mode = mode;
     node->size = 0;
     node->refs = 1;
 
-    directory_put(get_inode(tree_lookup(parent)), item, new_inode);
+    inode_t *dir = get_inode(parent);
+    node->flags = dir->flags & INODE_INHERITED;
+    if (directory_put(dir, item, new_inode) < 0) {
+        free_inode(new_inode);
+        return -ENOSPC;
+    }
+    times_init(new_inode);
+    times_touch(parent, TOUCH_MTIME | TOUCH_CTIME);
+    storage_invalidate(new_inode);
+    return 0;
+
+}
+
+// Creates the object as one journal operation, see mknod_help.
+int storage_mknod(const char *path, int mode) {
+    journal_begin();
+    int rv = mknod_help(path, mode);
+    journal_end();
+    return rv;
+}
+
+// Makes the file at the to path a copy of the file at the from path.
+// The data blocks are shared between the two files instead of copied;
+// write_help gives each file its own copy of a page once it's written.
+static int clone_help(const char *from, const char *to) {
+    int src_inum = tree_lookup(from);
+    int dst_inum = tree_lookup(to);
+    if (src_inum < 0 || dst_inum < 0) {
+        return src_inum < 0 ? src_inum : dst_inum;
+    }
+    if (src_inum == dst_inum) {
+        return 0;
+    }
+
+    inode_t *src = get_inode(src_inum);
+    inode_t *dst = get_inode(dst_inum);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) {
+        return -EISDIR;
+    }
+
+    truncate_help(dst_inum, dst, 0);
+    storage_invalidate(dst_inum);
+    int old_flags = dst->flags;
+    dst->flags = src->flags;
+    for (int i = 0; i <= src->size / 4096; ++i) {
+        if (inode_share_page(dst, i * 4096, src, i * 4096) < 0) {
+            // let go of the pages shared so far, leaving dst empty as the
+            // truncation above did
+            dst->size = i * 4096;
+            shrink_inode(dst, 0);
+            if (dst->direct_pointers[0]) {
+                free_block(dst->direct_pointers[0]);
+                dst->direct_pointers[0] = 0;
+            }
+            dst->size = 0;
+            dst->flags = old_flags;
+            return -ENOSPC;
+        }
+    }
+    dst->size = src->size;
+    times_touch(dst_inum, TOUCH_MTIME | TOUCH_CTIME);
+    return 0;
+}
+
+// Clones as one journal operation, see clone_help.
+int storage_clone(const char *from, const char *to) {
+    journal_begin();
+    int rv = clone_help(from, to);
+    journal_end();
+    return rv;
+}
+
+// Copies size bytes from the file at the from path to the file at the to
+// path. Whole pages are shared like in storage_clone, only partial pages at
+// the edges of the range (and compressed files) are actually copied.
+// Returns the number of bytes copied.
+static int copy_range_help(const char *from, off_t from_offset,
+                           const char *to, off_t to_offset, size_t size) {
+    int src_inum = tree_lookup(from);
+    int dst_inum = tree_lookup(to);
+    if (src_inum < 0 || dst_inum < 0) {
+        return src_inum < 0 ? src_inum : dst_inum;
+    }
+
+    inode_t *src = get_inode(src_inum);
+    inode_t *dst = get_inode(dst_inum);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) {
+        return -EISDIR;
+    }
+    if (from_offset >= src->size) {
+        return 0;
+    }
+    if ((off_t) size > src->size - from_offset) {
+        size = src->size - from_offset;
+    }
+    if (src_inum == dst_inum && from_offset < to_offset + (off_t) size &&
+        to_offset < from_offset + (off_t) size) {
+        return -EINVAL;
+    }
+    if (dst->size < to_offset + (off_t) size) {
+        int rv = truncate_help(dst_inum, dst, to_offset + size);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    char page[4096];
+    int copied = 0;
+    while (copied < (int) size) {
+        int src_i = from_offset + copied;
+        int dst_i = to_offset + copied;
+        int remainder = size - copied;
+
+        if (src_i % 4096 == 0 && dst_i % 4096 == 0 && remainder >= 4096 &&
+            !file_compressed(src) && !file_compressed(dst)) {
+            if (inode_share_page(dst, dst_i, src, src_i) < 0) {
+                break;
+            }
+            copied += 4096;
+            continue;
+        }
+
+        int chunk = remainder;
+        if (chunk > 4096 - (src_i % 4096)) {
+            chunk = 4096 - (src_i % 4096);
+        }
+        if (chunk > 4096 - (dst_i % 4096)) {
+            chunk = 4096 - (dst_i % 4096);
+        }
+        if (file_read(src_inum, src, page, chunk, src_i) < 0 ||
+            file_write(dst_inum, dst, page, chunk, dst_i) < 0) {
+            break;
+        }
+        copied += chunk;
+    }
+    storage_invalidate(dst_inum);
+    if (copied == 0 && size > 0) {
+        return -ENOSPC;
+    }
+    times_touch(dst_inum, TOUCH_MTIME | TOUCH_CTIME);
+    return copied;
+}
+
+// Copies as one journal operation, see copy_range_help.
+int storage_copy_range(const char *from, off_t from_offset,
+                       const char *to, off_t to_offset, size_t size) {
+    journal_begin();
+    int rv = copy_range_help(from, from_offset, to, to_offset, size);
+    journal_end();
+    return rv;
+}
+
+// Sets the compression policy of the file at the given path,
+// "none" turns compression off. Data that's already written keeps its
+// current form until it's written again. Setting it on a directory only
+// affects the files created in it afterwards.
+static int set_compression_help(const char *path, const char *codec) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    inode_t *node = get_inode(inum);
+
+    if (strcmp(codec, "none") == 0) {
+        node->flags &= ~INODE_COMPRESS;
+    } else {
+        int id = compress_codec_id(codec);
+        if (id < 0) {
+            return -EINVAL;
+        }
+        node->flags = INODE_SET_CODEC(node->flags, id) | INODE_COMPRESS;
+    }
+    compress_forget(inum);
+    times_touch(inum, TOUCH_CTIME);
+    return 0;
+}
+
+// Sets the compression policy, see set_compression_help.
+int storage_set_compression(const char *path, const char *codec) {
+    journal_begin();
+    int rv = set_compression_help(path, codec);
+    journal_end();
+    return rv;
+}
+
+// Gets the name of the codec the file at the given path is compressed with.
+int storage_get_compression(const char *path, char *codec) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    const inode_t *node = peek_inode(inum);
+    if (node->flags & INODE_COMPRESS) {
+        strncpy(codec, compress_codec(INODE_CODEC(node->flags))->name, CODEC_NAME_LENGTH);
+    } else {
+        strncpy(codec, "none", CODEC_NAME_LENGTH);
+    }
+    return 0;
+}
+
+// Turns deduplication of the file at the given path on or off.
+// Like compression, setting it on a directory is inherited by new files.
+static int set_dedup_help(const char *path, int on) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    inode_t *node = get_inode(inum);
+    if (on) {
+        node->flags |= INODE_DEDUP;
+    } else {
+        node->flags &= ~INODE_DEDUP;
+    }
+    times_touch(inum, TOUCH_CTIME);
     return 0;
+}
+
+// Turns deduplication on or off, see set_dedup_help.
+int storage_set_dedup(const char *path, int on) {
+    journal_begin();
+    int rv = set_dedup_help(path, on);
+    journal_end();
+    return rv;
+}
 
+// Is the file at the given path deduplicated?
+int storage_get_dedup(const char *path) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    return (peek_inode(inum)->flags & INODE_DEDUP) != 0;
 }
 
-// Removes a link
+// Preallocates blocks for the given range of the file at the given path, or
+// with FALLOC_FL_PUNCH_HOLE frees them, see man 2 fallocate. Preallocated
+// blocks come in consecutive runs and read as zeros, so writing the range
+// later needs no allocations. With FALLOC_FL_KEEP_SIZE they can go past the
+// end of the file, which keeps its size.
+static int fallocate_help(const char *path, int mode, off_t offset, off_t length) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return inum;
+    }
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) {
+        return -EISDIR;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) ||
+        ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) ||
+        file_compressed(node)) {
+        return -EOPNOTSUPP;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (offset + length > INODE_MAX_SIZE) {
+            length = INODE_MAX_SIZE - offset;
+        }
+        if (length > 0 && inode_punch_hole(node, offset, offset + length) < 0) {
+            return -ENOSPC;
+        }
+        times_touch(inum, TOUCH_MTIME | TOUCH_CTIME);
+        return 0;
+    }
+
+    if (offset + length > INODE_MAX_SIZE) {
+        return -EFBIG;
+    }
+    if (inode_preallocate(node, offset, offset + length) < 0) {
+        return -ENOSPC;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && node->size < offset + length) {
+        node->size = offset + length;
+        times_touch(inum, TOUCH_MTIME | TOUCH_CTIME);
+    } else {
+        times_touch(inum, TOUCH_CTIME);
+    }
+    return 0;
+}
+
+// Preallocates or punches out the range as one journal operation.
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length) {
+    journal_begin();
+    int rv = fallocate_help(path, mode, offset, length);
+    journal_end();
+    return rv;
+}
+
+// Drops a link to the inode, whose name is already gone from its
+// directory. The inode and its blocks are freed with the last link.
+static void drop_link(int inum) {
+    inode_t *node = get_inode(inum);
+    node->refs -= 1;
+    if (node->refs > 0) {
+        times_touch(inum, TOUCH_CTIME);
+        return;
+    }
+    compress_forget(inum);
+    free_inode(inum);
+}
+
+// Removes the name at the given path. Directories can't be unlinked.
+static int unlink_help(const char *path) {
+    const char *item;
+    int parent = parent_lookup(path, &item);
+    if (parent < 0) {
+        return parent;
+    }
+    int inum = directory_lookup(peek_inode(parent), item);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    if (S_ISDIR(peek_inode(inum)->mode)) {
+        return -EISDIR;
+    }
+    directory_delete(get_inode(parent), item);
+    times_touch(parent, TOUCH_MTIME | TOUCH_CTIME);
+    drop_link(inum);
+    return 0;
+}
+
+// Removes a link as one journal operation.
 int storage_unlink(const char *path) {
+    journal_begin();
+    int rv = unlink_help(path);
+    journal_end();
+    return rv;
+}
+
+// Adds the name at the from path for the file at the to path (nufs_link
+// passes them in that order).
+static int link_help(const char *from, const char *to) {
+    int inum = tree_lookup(to);
+    if (inum < 0) {
+        return inum;
+    }
+    if (S_ISDIR(peek_inode(inum)->mode)) {
+        return -EPERM;
+    }
+    const char *item;
+    int parent = parent_lookup(from, &item);
+    if (parent < 0) {
+        return parent;
+    }
+    if (directory_lookup(peek_inode(parent), item) >= 0) {
+        return -EEXIST;
+    }
+    if (directory_put(get_inode(parent), item, inum) < 0) {
+        return -ENOSPC;
+    }
+    get_inode(inum)->refs += 1;
+    times_touch(parent, TOUCH_MTIME | TOUCH_CTIME);
+    times_touch(inum, TOUCH_CTIME);
     return 0;
 }
 
-// Adds a link
+// Adds a link as one journal operation.
 int storage_link(const char *from, const char *to) {
+    journal_begin();
+    int rv = link_help(from, to);
+    journal_end();
+    return rv;
+}
+
+// Moves the name at the from path to the to path. A file already at the
+// to path loses that link; a directory there is never replaced.
+static int rename_help(const char *from, const char *to) {
+    const char *from_item;
+    int from_parent = parent_lookup(from, &from_item);
+    if (from_parent < 0) {
+        return from_parent;
+    }
+    int inum = directory_lookup(peek_inode(from_parent), from_item);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    int is_dir = S_ISDIR(peek_inode(inum)->mode);
+    size_t from_len = strlen(from);
+    if (is_dir && strncmp(to, from, from_len) == 0 && to[from_len] == '/') {
+        // a directory can't be moved into itself
+        return -EINVAL;
+    }
+
+    const char *to_item;
+    int to_parent = parent_lookup(to, &to_item);
+    if (to_parent < 0) {
+        return to_parent;
+    }
+    int old = directory_lookup(peek_inode(to_parent), to_item);
+    if (old == inum) {
+        return 0;
+    }
+    if (old >= 0) {
+        if (S_ISDIR(peek_inode(old)->mode)) {
+            return is_dir ? -EEXIST : -EISDIR;
+        }
+        if (is_dir) {
+            return -ENOTDIR;
+        }
+        // the record is freed for the same name, so the put below fits
+        directory_delete(get_inode(to_parent), to_item);
+    }
+    if (directory_put(get_inode(to_parent), to_item, inum) < 0) {
+        return -ENOSPC;
+    }
+    directory_delete(get_inode(from_parent), from_item);
+    times_touch(from_parent, TOUCH_MTIME | TOUCH_CTIME);
+    times_touch(to_parent, TOUCH_MTIME | TOUCH_CTIME);
+    times_touch(inum, TOUCH_CTIME);
+    if (old >= 0) {
+        drop_link(old);
+    }
     return 0;
 }
 
-// Renames the file at the from path to the to path
+// Renames the file at the from path to the to path as one journal
+// operation, so a crash never leaves it under both names or neither.
 int storage_rename(const char *from, const char *to) {
-    return 0;
+    journal_begin();
+    int rv = rename_help(from, to);
+    journal_end();
+    return rv;
 }
 
-// Sets the times? Not really sure why we need this, no tests on it
+// Sets the access and modification times, see times_set.
 int storage_set_time(const char *path, const struct timespec ts[2]) {
+    journal_begin();
+    int inum = tree_lookup(path);
+    if (inum >= 0) {
+        times_set(inum, ts);
+    }
+    journal_end();
+    return inum < 0 ? inum : 0;
+}
+
+// Called when a file is closed. Its data is already in the image, and its
+// cached timestamps are left to fsync, the flush interval or eviction, so
+// closing doesn't undo their batching (see timestamps.h).
+int storage_flush(const char *path) {
+    int inum = tree_lookup(path);
+    return inum < 0 ? inum : 0;
+}
+
+// Makes sure the file's data and all metadata are on disk. Only the file's
+// own data blocks are written back, then the journal is committed, together
+// with whatever other fsyncs are waiting for a commit at the same time.
+int storage_fsync(const char *path) {
+    int pages[INODE_MAX_PAGES];
+    int count = 0;
+
+    journal_begin();
+    int inum = tree_lookup(path);
+    if (inum >= 0) {
+        times_flush(inum);
+        const inode_t *node = peek_inode(inum);
+        for (int fpn = 0; fpn < node->size; fpn += 4096) {
+            int pnum = inode_get_pnum(node, fpn);
+            if (pnum) {
+                pages[count++] = pnum;
+            }
+        }
+    }
+    journal_end();
+
+    journal_write_data(pages, count);
+    journal_commit();
+    return inum < 0 ? inum : 0;
+}
+
+// Fills in the filesystem statistics. Blocks reserved by writer threads
+// but not used yet are still free.
+int storage_statfs(struct statvfs *st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = BLOCK_COUNT;
+    st->f_bfree = free_block_count();
+    st->f_bavail = st->f_bfree;
+    st->f_files = inode_count();
+    st->f_ffree = free_inode_count();
+    st->f_favail = st->f_ffree;
+    st->f_namemax = DIR_NAME_LENGTH - 1;
     return 0;
 }
 
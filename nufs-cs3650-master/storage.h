@@ -8,6 +8,7 @@
 #define NUFS_STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -15,15 +16,30 @@
 #include "slist.h"
 
 void storage_init(const char *path);
+void storage_start_writeback();
+void storage_free();
+int storage_access(const char *path);
 int storage_stat(const char *path, struct stat *st);
+int storage_open(const char *path);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
+int storage_clone(const char *from, const char *to);
+int storage_copy_range(const char *from, off_t from_offset,
+                       const char *to, off_t to_offset, size_t size);
+int storage_set_compression(const char *path, const char *codec);
+int storage_get_compression(const char *path, char *codec);
+int storage_set_dedup(const char *path, int on);
+int storage_get_dedup(const char *path);
+int storage_flush(const char *path);
+int storage_fsync(const char *path);
+int storage_statfs(struct statvfs *st);
 slist_t *storage_list(const char *path);
 
 #endif
@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 105;
 use IO::Handle;
 
 sub mount {
@@ -14,6 +14,46 @@ sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# Starts a section of the tests on a new, empty image.
+sub new_image {
+    my ($title) = @_;
+    say "#           == $title ==";
+    system("rm -f data.nufs");
+    mount();
+}
+
+# Mounts the image again, so what's read next comes from the image and
+# not from the kernel's caches.
+sub remount {
+    unmount();
+    mount();
+}
+
+# Mounts the image given by spec, see blocks_init in blocks.c.
+# nufs runs single threaded unless other options are given.
+sub mount_image {
+    my ($spec, $options) = @_;
+    $options //= "-s";
+    system("mkdir -p mnt");
+    system("(./nufs $options -f mnt $spec 2>&1) >> test.log &");
+    sleep 1;
+}
+
+# Finds the block of the (single file) image that holds the given page,
+# or -1. The first block of the file is the member header.
+sub image_block {
+    my ($image, $page) = @_;
+    my $pos = index($image, $page);
+    return $pos < 0 || $pos % 4096 ? -1 : $pos / 4096 - 1;
+}
+
+# Kills nufs without letting it write anything back, like a power cut.
+sub crash {
+    system("pkill -9 -x nufs");
+    sleep 1;
+    unmount();
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -41,6 +81,57 @@ sub read_text_slice {
     return $data;
 }
 
+sub write_data {
+    my ($name, $data) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    print $fh $data;
+    close $fh;
+}
+
+sub read_data {
+    my ($name) = @_;
+    open my $fh, "<", "mnt/$name" or return "";
+    local $/ = undef;
+    my $data = <$fh> // "";
+    close $fh;
+    return $data;
+}
+
+sub mtime {
+    my ($name) = @_;
+    return (stat("mnt/$name"))[9] // -1;
+}
+
+sub free_blocks {
+    my $free = `stat -f -c %f mnt`;
+    chomp $free;
+    return $free || 0;
+}
+
+# Request numbers from nufs_ioctl.h, see _IOC in <asm-generic/ioctl.h>.
+# dir is 1 for _IOW, 2 for _IOR and 3 for _IOWR.
+sub nufs_ioc {
+    my ($dir, $nr, $size) = @_;
+    return ($dir << 30) | ($size << 16) | (ord('N') << 8) | $nr;
+}
+
+my $NUFS_IOC_CLONE = nufs_ioc(1, 1, 256);
+my $NUFS_IOC_COPY_RANGE = nufs_ioc(3, 2, 256 + 3 * 8);
+my $NUFS_IOC_SET_COMPRESSION = nufs_ioc(1, 3, 16);
+my $NUFS_IOC_GET_COMPRESSION = nufs_ioc(2, 4, 16);
+my $NUFS_IOC_SET_DEDUP = nufs_ioc(1, 5, 4);
+my $NUFS_IOC_GET_DEDUP = nufs_ioc(2, 6, 4);
+
+# Calls a nufs ioctl on the file. The packed argument is updated in place
+# for ioctls that return something.
+sub nufs_ioctl {
+    my ($name, $request) = @_;
+    open my $fh, "+<", "mnt/$name" or return 0;
+    my $rv = ioctl($fh, $request, $_[2]);
+    close $fh;
+    return $rv;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -188,3 +279,436 @@ my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
 unmount();
+
+new_image("Clone and Copy Range");
+
+my $orig = "=This string is fourty characters long.=" x 1000;
+write_data("orig.txt", $orig);
+write_data("clone.txt", "");
+write_data("range.txt", "");
+
+my $free0 = free_blocks();
+my $clone_args = pack("Z256", "/orig.txt");
+ok(nufs_ioctl("clone.txt", $NUFS_IOC_CLONE, $clone_args), "clone ioctl");
+ok($free0 - free_blocks() <= 1, "clone shares the data blocks");
+
+my $range_args = pack("Z256 q q q", "/orig.txt", 4096, 0, 8192);
+ok(nufs_ioctl("range.txt", $NUFS_IOC_COPY_RANGE, $range_args), "copy range ioctl");
+my $copied = (unpack("Z256 q q q", $range_args))[3];
+ok($copied == 8192, "copy range copied all of the range");
+
+ok(read_data("clone.txt") eq $orig, "Read back clone.");
+ok(read_data("range.txt") eq substr($orig, 4096, 8192), "Read back copied range.");
+
+system("dd if=/dev/zero of=mnt/clone.txt bs=4096 count=1 conv=notrunc status=none");
+ok(read_data("orig.txt") eq $orig, "Writing to the clone leaves the original alone.");
+ok(read_data("clone.txt") eq ("\0" x 4096) . substr($orig, 4096), "Clone sees its own write.");
+
+unmount();
+
+new_image("Compression");
+
+write_data("packed.txt", "");
+my $codec_args = pack("Z16", "nosuchcodec");
+ok(!nufs_ioctl("packed.txt", $NUFS_IOC_SET_COMPRESSION, $codec_args), "unknown codec is rejected");
+$codec_args = pack("Z16", "lz");
+ok(nufs_ioctl("packed.txt", $NUFS_IOC_SET_COMPRESSION, $codec_args), "set compression");
+
+$free0 = free_blocks();
+my $text = "=This string is fourty characters long.=" x 1000;
+write_data("packed.txt", $text);
+ok($free0 - free_blocks() < 10, "compressed file takes fewer blocks");
+
+remount();
+
+ok(read_data("packed.txt") eq $text, "Read back compressed file.");
+$codec_args = pack("Z16", "");
+nufs_ioctl("packed.txt", $NUFS_IOC_GET_COMPRESSION, $codec_args);
+ok(unpack("Z16", $codec_args) eq "lz", "compression is kept");
+
+unmount();
+
+new_image("Deduplication");
+
+my $page = "=This string is fourty characters long.=" x 102 . "=" x 16;
+my $pages = $page x 8;
+my $dedup_args = pack("i", 1);
+write_data("dup1.txt", "");
+write_data("dup2.txt", "");
+nufs_ioctl("dup1.txt", $NUFS_IOC_SET_DEDUP, $dedup_args);
+nufs_ioctl("dup2.txt", $NUFS_IOC_SET_DEDUP, $dedup_args);
+
+$free0 = free_blocks();
+write_data("dup1.txt", $pages);
+ok($free0 - free_blocks() <= 2, "identical pages of a file share a block");
+$free0 = free_blocks();
+write_data("dup2.txt", $pages);
+ok($free0 - free_blocks() <= 1, "identical pages of another file share it too");
+
+remount();
+
+ok(read_data("dup1.txt") eq $pages, "Read back first deduplicated file.");
+ok(read_data("dup2.txt") eq $pages, "Read back second deduplicated file.");
+$dedup_args = pack("i", 0);
+nufs_ioctl("dup2.txt", $NUFS_IOC_GET_DEDUP, $dedup_args);
+ok(unpack("i", $dedup_args) == 1, "deduplication is kept");
+
+system("dd if=/dev/zero of=mnt/dup2.txt bs=4096 count=1 conv=notrunc status=none");
+ok(read_data("dup1.txt") eq $pages, "Writing to a shared page leaves the other file alone.");
+
+unmount();
+
+new_image("Path Lookup");
+
+my $deep = join("/", map { sprintf("level%02d", $_) } 1..30);
+system("mkdir -p mnt/$deep");
+ok(-d "mnt/$deep", "Made 30 nested directories");
+write_text("$deep/deep.txt", "deep down");
+ok(read_text("$deep/deep.txt") eq "deep down", "Read back file 30 levels down.");
+ok(!-e "mnt/level0" && !-e "mnt/level01/level0", "a prefix of a name isn't found");
+ok(!-e "mnt/level01/nosuchdir/level03", "missing directory in the middle of a path");
+ok(!-e "mnt/$deep/deep.txt/level31" && $!{ENOTDIR}, "a file in the middle of a path isn't a directory");
+
+my $found = 0;
+for my $ii (1..200) {
+    ++$found if -e "mnt/$deep/deep.txt";
+}
+ok($found == 200, "many lookups in a row");
+
+unmount();
+
+say "#           == io_uring Backend ==";
+system("rm -f *.o nufs data.nufs");
+system("(make BACKEND=uring nufs 2>&1) >> test.log");
+mount();
+
+write_data("ring.txt", $text);
+system("mkdir mnt/ring");
+write_text("ring/small.txt", "small");
+
+remount();
+
+ok(read_data("ring.txt") eq $text && read_text("ring/small.txt") eq "small",
+   "Read back through io_uring.");
+
+write_text("idle.txt", "written back while idle");
+# longer than the journal commit interval
+sleep 7;
+crash();
+mount();
+
+ok(read_text("idle.txt") eq "written back while idle", "idle write-back reached the disk");
+ok(read_data("ring.txt") eq $text, "Read back after a crash.");
+
+unmount();
+system("rm -f *.o nufs");
+system("(make nufs 2>&1) >> test.log");
+
+say "#           == Striping ==";
+system("rm -f data.nufs data2.nufs");
+mount_image("data.nufs,data2.nufs:8");
+
+write_data("striped.txt", $huge0);
+
+unmount();
+
+ok(-s "data.nufs" && -s "data.nufs" == -s "data2.nufs", "both members hold their share");
+
+mount_image("data.nufs,data2.nufs");
+ok(read_data("striped.txt") eq $huge0, "Read back striped file, stripe unit from the members.");
+unmount();
+
+mount_image("data2.nufs,data.nufs");
+ok(!-e "mnt/striped.txt", "members in the wrong order aren't mounted");
+unmount();
+
+mount_image("data.nufs,data2.nufs:4");
+ok(!-e "mnt/striped.txt", "the wrong stripe unit isn't mounted");
+unmount();
+
+system("rm -f data2.nufs");
+
+new_image("Allocation Groups");
+
+system("mkdir mnt/tree1 mnt/tree2");
+# two pages, so the files don't need an indirect block
+my @pages1 = map { "one$_" x 1024 } 0..1;
+my @pages2 = map { "two$_" x 1024 } 0..1;
+write_data("tree1/data", join("", @pages1));
+write_data("tree2/data", join("", @pages2));
+
+unmount();
+
+open my $img_fh, "<:raw", "data.nufs" or die "data.nufs: $!";
+my $image = do { local $/ = undef; <$img_fh> };
+close $img_fh;
+my @blocks1 = map { image_block($image, $_) } @pages1;
+my @blocks2 = map { image_block($image, $_) } @pages2;
+say "# tree1 blocks @blocks1, tree2 blocks @blocks2";
+
+ok($blocks1[0] > 0 && $blocks1[1] == $blocks1[0] + 1,
+   "pages of a file are in consecutive blocks");
+ok($blocks2[0] > 0 && $blocks2[1] == $blocks2[0] + 1,
+   "pages of another file are in consecutive blocks");
+# 4 groups of 64 blocks
+ok(int($blocks1[0] / 64) != int($blocks2[0] / 64),
+   "top-level directories are spread over allocation groups");
+
+say "#           == Concurrent Writers ==";
+system("rm -f data.nufs");
+mount_image("data.nufs", "");
+
+system(q{for c in 1 2 3 4; do
+             (for i in 1 2 3 4 5 6 7 8; do
+                  head -c 6000 /dev/zero | tr '\\0' $c > mnt/w$c-$i
+              done) &
+         done; wait});
+
+my $good = 0;
+for my $c (1..4) {
+    for my $i (1..8) {
+        ++$good if read_data("w$c-$i") eq $c x 6000;
+    }
+}
+ok($good == 32, "files written by 4 writers at once read back");
+
+$free0 = free_blocks();
+remount();
+ok(free_blocks() == $free0, "no blocks stay reserved after unmount");
+
+unmount();
+
+new_image("Directory Entries");
+
+my $longest = "n" x 255;
+write_text($longest, "longest name");
+ok(read_text($longest) eq "longest name", "Read back file with a 255 character name.");
+ok(!open(my $too_long, ">", "mnt/${longest}n"), "256 character name is refused");
+
+system("mkdir mnt/names");
+my $prefix = "a-much-longer-file-name-that-takes-up-more-room-in-the-dir-";
+for my $ii (1..80) {
+    write_text("names/$prefix$ii", "$ii");
+}
+for my $ii (grep { $_ % 2 == 0 } 1..80) {
+    unlink("mnt/names/$prefix$ii");
+}
+my $dir_size = -s "mnt/names";
+for my $ii (1..40) {
+    write_text("names/s$ii", "s$ii");
+}
+ok(-s "mnt/names" == $dir_size, "short names reuse the room of deleted ones");
+
+$nn = `ls mnt/names | wc -l`;
+ok($nn == 80, "80 names after deleting and adding");
+ok(!-e "mnt/names/${prefix}40", "deleted name is gone");
+ok(read_text("names/${prefix}39") eq "39" && read_text("names/s40") eq "s40",
+   "Read back files next to deleted names.");
+
+unmount();
+
+new_image("Timestamps");
+
+my $started = time();
+write_text("stamp.txt", "stamp");
+ok(mtime("stamp.txt") >= $started - 1, "writing sets mtime");
+system("touch -m -d \@981173106 mnt/stamp.txt");
+
+unmount();
+# in the background, as without -f, so the idle flush below needs the
+# write-back thread started after nufs forked
+system("(./nufs -s mnt data.nufs 2>&1) >> test.log");
+
+ok(mtime("stamp.txt") == 981173106, "mtime set by utimens is kept");
+
+system("touch -m -d \@1000000000 mnt/stamp.txt");
+write_text("lazy.txt", "lazy");
+system("touch -m -d \@1000000001 mnt/lazy.txt");
+# the cached times are written back every 30 seconds, even when idle
+sleep 40;
+crash();
+mount();
+
+ok(mtime("stamp.txt") == 1000000000, "changed mtime reached the disk while idle");
+ok(mtime("lazy.txt") == 1000000001, "mtime of a new file reached the disk while idle");
+
+unmount();
+
+new_image("Kernel Caching");
+
+write_data("cache-a.txt", "A" x 8192);
+write_data("cache-b.txt", "B" x 8192);
+write_data("cache-c.txt", "C" x 8192);
+# get the pages into the kernel's cache
+read_data("cache-b.txt");
+read_data("cache-c.txt");
+
+$clone_args = pack("Z256", "/cache-a.txt");
+nufs_ioctl("cache-b.txt", $NUFS_IOC_CLONE, $clone_args);
+ok(read_data("cache-b.txt") eq "A" x 8192, "cached pages are dropped after a clone");
+
+$range_args = pack("Z256 q q q", "/cache-a.txt", 0, 0, 4096);
+nufs_ioctl("cache-c.txt", $NUFS_IOC_COPY_RANGE, $range_args);
+ok(read_data("cache-c.txt") eq "A" x 4096 . "C" x 4096, "cached pages are dropped after a copy range");
+ok(read_data("cache-a.txt") eq "A" x 8192, "Read back the source from the cache.");
+
+# the kernel has seen the old, smaller size
+write_data("cache-d.txt", "D" x 100);
+read_data("cache-d.txt");
+nufs_ioctl("cache-d.txt", $NUFS_IOC_CLONE, $clone_args);
+ok(-s "mnt/cache-d.txt" == 8192 && read_data("cache-d.txt") eq "A" x 8192,
+   "new size is seen right after a clone");
+
+unmount();
+
+new_image("Large and Sparse Writes");
+
+my $big = join("", map { sprintf("%07d\n", $_) } 1..40000);
+open my $big_fh, ">", "mnt/big.txt" or die "big.txt: $!";
+syswrite($big_fh, $big);
+close $big_fh;
+ok(read_data("big.txt") eq $big, "Read back 320k written at once.");
+
+$free0 = free_blocks();
+open my $sparse_fh, ">", "mnt/sparse.txt" or die "sparse.txt: $!";
+sysseek($sparse_fh, 2000000, 0);
+syswrite($sparse_fh, "tail");
+close $sparse_fh;
+ok(-s "mnt/sparse.txt" == 2000004, "sparse file has the right size");
+ok($free0 - free_blocks() <= 2, "the hole takes no blocks");
+ok(read_text_slice("sparse.txt", 4, 2000000) eq "tail" &&
+   read_text_slice("sparse.txt", 4096, 4096) eq "\0" x 4096, "Read back sparse file.");
+
+open my $ooo_fh, ">", "mnt/ooo.txt" or die "ooo.txt: $!";
+for my $ii (reverse 0..7) {
+    sysseek($ooo_fh, $ii * 5000, 0);
+    syswrite($ooo_fh, "$ii" x 5000);
+}
+close $ooo_fh;
+ok(read_data("ooo.txt") eq join("", map { "$_" x 5000 } 0..7), "Read back file written backwards.");
+
+unmount();
+
+new_image("Journal Recovery");
+
+system("mkdir mnt/journal");
+for my $ii (1..10) {
+    write_text("journal/$ii.txt", "entry $ii");
+}
+rename("mnt/journal/10.txt", "mnt/journal/ten.txt");
+unlink("mnt/journal/9.txt");
+open my $sync_fh, ">", "mnt/journal/synced.txt" or die "synced.txt: $!";
+print $sync_fh $huge0;
+$sync_fh->flush;
+$sync_fh->sync;
+close $sync_fh;
+$free0 = free_blocks();
+
+# killed right away, before the periodic commit, so the fsync has to
+# have put everything on the disk
+crash();
+mount();
+
+ok(read_data("journal/synced.txt") eq $huge0, "fsynced file is there after a crash");
+$nn = `ls mnt/journal | wc -l`;
+ok($nn == 10, "operations before the fsync are there after a crash");
+# only the fsynced file's data is written back before the commit, the
+# other files are there by name
+ok(-e "mnt/journal/ten.txt" && !-e "mnt/journal/10.txt" && !-e "mnt/journal/9.txt",
+   "rename and unlink are there after a crash");
+ok(free_blocks() == $free0, "no blocks lost in the crash");
+
+unmount();
+
+say "#           == Trace and Replay ==";
+system("rm -f data.nufs replay.nufs test.trace");
+{
+    local $ENV{NUFS_TRACE} = "test.trace";
+    mount_image("data.nufs");
+}
+
+system("mkdir mnt/traced");
+for my $ii (1..5) {
+    write_text("traced/$ii.txt", "traced $ii" x $ii);
+}
+write_data("traced/big.txt", $huge0);
+rename("mnt/traced/5.txt", "mnt/traced/five.txt");
+unlink("mnt/traced/4.txt");
+read_data("traced/big.txt");
+my $traced = `cd mnt/traced && ls -l | awk 'NR > 1 { print \$5, \$9 }'`;
+
+unmount();
+
+ok(-s "test.trace", "trace was recorded");
+my $report = `./nufs_replay test.trace replay.nufs`;
+ok($? == 0, "trace replays");
+my $mismatches = 0;
+for my $line (split /\n/, $report) {
+    $mismatches += $1 if $line =~ /^\w+\s+\d+\s+[\d.]+\s+[\d.]+\s+(\d+)$/;
+}
+ok($mismatches == 0, "replayed operations give the recorded results");
+
+mount_image("replay.nufs");
+ok(`cd mnt/traced && ls -l | awk 'NR > 1 { print \$5, \$9 }'` eq $traced,
+   "replayed image has the same files and sizes");
+unmount();
+
+system("rm -f replay.nufs test.trace");
+
+new_image("Preallocation and Holes");
+
+$free0 = free_blocks();
+system("fallocate -l 40960 mnt/prealloc.bin");
+ok(-s "mnt/prealloc.bin" == 40960, "fallocate sets the size");
+ok($free0 - free_blocks() >= 10, "fallocate takes the blocks up front");
+ok(read_data("prealloc.bin") eq "\0" x 40960, "preallocated blocks read as zeros");
+
+$free0 = free_blocks();
+system("fallocate -k -o 40960 -l 16384 mnt/prealloc.bin");
+ok(-s "mnt/prealloc.bin" == 40960 && $free0 - free_blocks() >= 4,
+   "fallocate --keep-size preallocates past the end");
+
+write_data("punch.txt", "P" x 16384);
+$free0 = free_blocks();
+system("fallocate -p -o 4096 -l 8192 mnt/punch.txt");
+ok(free_blocks() - $free0 == 2, "punching a hole frees its blocks");
+
+remount();
+
+ok(read_data("punch.txt") eq "P" x 4096 . "\0" x 8192 . "P" x 4096, "Read back file with a hole punched.");
+ok(-s "mnt/prealloc.bin" == 40960 && read_data("prealloc.bin") eq "\0" x 40960,
+   "preallocated file is kept");
+
+system("printf x | dd of=mnt/prealloc.bin bs=1 seek=5000 conv=notrunc status=none");
+ok(read_data("prealloc.bin") eq "\0" x 5000 . "x" . "\0" x 35959,
+   "rest of a preallocated page reads as zeros after a one byte write");
+
+unmount();
+
+say "#           == Building Images ==";
+system("rm -rf data.nufs mkfs-src");
+system("mkdir -p mkfs-src/a/b mkfs-src/c mkfs-src/empty");
+for my $name ("top.txt", "a/one.txt", "a/b/two.txt", "c/three.txt") {
+    open my $src_fh, ">", "mkfs-src/$name" or die "$name: $!";
+    print $src_fh "contents of $name\n" x 20;
+    close $src_fh;
+}
+open my $src_fh, ">", "mkfs-src/a/b/huge.txt" or die "huge.txt: $!";
+print $src_fh $huge0;
+close $src_fh;
+utime(981173106, 981173106, "mkfs-src/a/one.txt");
+
+system("(./mkfs.nufs -j 4 -d mkfs-src data.nufs 2>&1) >> test.log");
+ok($? == 0, "mkfs.nufs builds an image");
+system("(./mkfs.nufs -d mkfs-src data.nufs:0 2>&1) >> test.log");
+ok($? != 0, "mkfs.nufs refuses a bad image spec");
+
+mount();
+
+system("(diff -r mkfs-src mnt 2>&1) >> test.log");
+ok($? == 0, "image has the same tree as the source directory");
+ok(mtime("a/one.txt") == 981173106, "image keeps the modification times");
+ok(-d "mnt/empty", "image has the empty directory");
+
+unmount();
+system("rm -rf mkfs-src");
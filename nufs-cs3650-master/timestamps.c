@@ -0,0 +1,218 @@
+// Implementation of timestamps.h
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "timestamps.h"
+
+#define TIMES_SLOTS 32
+#define RELATIME_MAX_AGE (24 * 60 * 60) // seconds
+
+// An inode's times in the cache. dirty is set if they differ from the table.
+typedef struct times_cache_entry {
+    int used;
+    int dirty;
+    int inum;
+    unsigned long last_use;
+    inode_times_t times;
+} times_cache_entry_t;
+
+static pthread_mutex_t times_lock = PTHREAD_MUTEX_INITIALIZER;
+static times_cache_entry_t times_cache[TIMES_SLOTS];
+static unsigned long times_clock = 0;
+static time_t last_flush = 0;
+
+// Converts between stored and in-memory timestamps.
+static stamp_t to_stamp(struct timespec ts) {
+    stamp_t stamp = {(uint32_t) ts.tv_sec, (uint32_t) ts.tv_nsec};
+    return stamp;
+}
+
+static struct timespec from_stamp(stamp_t stamp) {
+    struct timespec ts = {stamp.sec, stamp.nsec};
+    return ts;
+}
+
+// Gets the current time.
+static stamp_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return to_stamp(ts);
+}
+
+// Compares two timestamps like strcmp.
+static int stamp_cmp(stamp_t a, stamp_t b) {
+    if (a.sec != b.sec) {
+        return a.sec < b.sec ? -1 : 1;
+    }
+    if (a.nsec != b.nsec) {
+        return a.nsec < b.nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// Writes a cache entry back to the table. Must hold times_lock.
+static void entry_flush(times_cache_entry_t *entry) {
+    if (entry->used && entry->dirty) {
+        inode_times_t *table = get_inode_times();
+        table[entry->inum] = entry->times;
+        entry->dirty = 0;
+        printf("+ times_flush(%d)\n", entry->inum);
+    }
+}
+
+// Gets the inode's times from the cache, reading them in from the table and
+// evicting the least recently used entry if needed. Must hold times_lock.
+static times_cache_entry_t *entry_load(int inum) {
+    times_cache_entry_t *victim = &times_cache[0];
+    for (int i = 0; i < TIMES_SLOTS; ++i) {
+        times_cache_entry_t *entry = &times_cache[i];
+        if (entry->used && entry->inum == inum) {
+            entry->last_use = ++times_clock;
+            return entry;
+        }
+        if (!entry->used || (victim->used && entry->last_use < victim->last_use)) {
+            victim = entry;
+        }
+    }
+
+    entry_flush(victim);
+    const inode_times_t *table = peek_inode_times();
+    victim->used = 1;
+    victim->dirty = 0;
+    victim->inum = inum;
+    victim->times = table[inum];
+    victim->last_use = ++times_clock;
+    return victim;
+}
+
+
+// Set the given times of the inode to now, in the cache only.
+void times_touch(int inum, int which) {
+    stamp_t at = now();
+    pthread_mutex_lock(&times_lock);
+    times_cache_entry_t *entry = entry_load(inum);
+    inode_times_t *times = &entry->times;
+
+    if (which & TOUCH_ATIME) {
+        // relatime: only note accesses after a change, or once a day
+        if (stamp_cmp(times->atime, times->mtime) <= 0 ||
+            stamp_cmp(times->atime, times->ctime) <= 0 ||
+            at.sec - times->atime.sec >= RELATIME_MAX_AGE) {
+            times->atime = at;
+            entry->dirty = 1;
+        }
+    }
+    if (which & TOUCH_MTIME) {
+        times->mtime = at;
+        entry->dirty = 1;
+    }
+    if (which & TOUCH_CTIME) {
+        times->ctime = at;
+        entry->dirty = 1;
+    }
+
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Set all times of a new inode to now and write them to the table.
+void times_init(int inum) {
+    stamp_t at = now();
+    pthread_mutex_lock(&times_lock);
+    times_cache_entry_t *entry = entry_load(inum);
+    entry->times.atime = at;
+    entry->times.mtime = at;
+    entry->times.ctime = at;
+    entry->dirty = 1;
+    entry_flush(entry);
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Set the access and modification times of the inode and write them through.
+void times_set(int inum, const struct timespec ts[2]) {
+    stamp_t at = now();
+    pthread_mutex_lock(&times_lock);
+    times_cache_entry_t *entry = entry_load(inum);
+    inode_times_t *times = &entry->times;
+
+    stamp_t *targets[2] = {&times->atime, &times->mtime};
+    for (int i = 0; i < 2; ++i) {
+        if (ts[i].tv_nsec == UTIME_NOW) {
+            *targets[i] = at;
+        } else if (ts[i].tv_nsec != UTIME_OMIT) {
+            *targets[i] = to_stamp(ts[i]);
+        }
+    }
+    times->ctime = at;
+    entry->dirty = 1;
+    entry_flush(entry);
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Fill in the times of the inode in the stat.
+void times_get(int inum, struct stat *st) {
+    pthread_mutex_lock(&times_lock);
+    times_cache_entry_t *entry = entry_load(inum);
+    st->st_atim = from_stamp(entry->times.atime);
+    st->st_mtim = from_stamp(entry->times.mtime);
+    st->st_ctim = from_stamp(entry->times.ctime);
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Write the cached times of the inode to the table.
+void times_flush(int inum) {
+    pthread_mutex_lock(&times_lock);
+    for (int i = 0; i < TIMES_SLOTS; ++i) {
+        if (times_cache[i].used && times_cache[i].inum == inum) {
+            entry_flush(&times_cache[i]);
+        }
+    }
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Write all cached times to the table.
+void times_flush_all() {
+    pthread_mutex_lock(&times_lock);
+    for (int i = 0; i < TIMES_SLOTS; ++i) {
+        entry_flush(&times_cache[i]);
+    }
+    last_flush = now().sec;
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Write all cached times to the table if the last time was at least
+// TIMES_FLUSH_INTERVAL seconds ago.
+void times_flush_due() {
+    stamp_t at = now();
+    pthread_mutex_lock(&times_lock);
+    if (at.sec - last_flush >= TIMES_FLUSH_INTERVAL) {
+        for (int i = 0; i < TIMES_SLOTS; ++i) {
+            entry_flush(&times_cache[i]);
+        }
+        last_flush = at.sec;
+    }
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Drop the inode's cached times without writing them.
+void times_forget(int inum) {
+    pthread_mutex_lock(&times_lock);
+    for (int i = 0; i < TIMES_SLOTS; ++i) {
+        if (times_cache[i].inum == inum) {
+            times_cache[i].used = 0;
+        }
+    }
+    pthread_mutex_unlock(&times_lock);
+}
+
+// Write all cached times to the table and empty the cache.
+void times_close() {
+    pthread_mutex_lock(&times_lock);
+    for (int i = 0; i < TIMES_SLOTS; ++i) {
+        entry_flush(&times_cache[i]);
+        times_cache[i].used = 0;
+    }
+    pthread_mutex_unlock(&times_lock);
+}
@@ -0,0 +1,63 @@
+// Inode timestamps with lazy persistence.
+//
+// The access, modification and change times of every inode are kept in a
+// table in the second to last block of the image, one inode_times_t per inum.
+// Updates from reads and writes only go to a small in-memory cache, and reach
+// the table in batches: when the cache entry is evicted, when the file is
+// fsynced, every TIMES_FLUSH_INTERVAL seconds, or on unmount. The interval
+// is checked by storage.c's write-back thread, so it's kept when the
+// filesystem is idle, as long as the thread was started with
+// storage_start_writeback once nufs is in the background. Access times
+// follow relatime: they're only moved forward if they're older than the
+// modification or change time, or more than a day old. Times set explicitly
+// with times_set are written to the table right away.
+
+#ifndef TIMESTAMPS_H
+#define TIMESTAMPS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define TIMES_FLUSH_INTERVAL 30 // seconds
+
+// Which times times_touch updates
+#define TOUCH_ATIME 0x1
+#define TOUCH_MTIME 0x2
+#define TOUCH_CTIME 0x4
+
+// A timestamp as stored in the table
+typedef struct stamp {
+    uint32_t sec;
+    uint32_t nsec;
+} stamp_t;
+
+// An inode's entry in the times table
+typedef struct inode_times {
+    stamp_t atime;
+    stamp_t mtime;
+    stamp_t ctime;
+} inode_times_t;
+
+// Set all times of a new inode to now and write them to the table.
+void times_init(int inum);
+// Set the given times of the inode to now, in the cache only.
+void times_touch(int inum, int which);
+// Set the access and modification times of the inode, honoring UTIME_NOW
+// and UTIME_OMIT, and write them to the table along with a new change time.
+void times_set(int inum, const struct timespec ts[2]);
+// Fill in the times of the inode in the stat.
+void times_get(int inum, struct stat *st);
+// Write the cached times of the inode to the table.
+void times_flush(int inum);
+// Write all cached times to the table.
+void times_flush_all();
+// Write all cached times to the table if TIMES_FLUSH_INTERVAL seconds have
+// passed since the last time.
+void times_flush_due();
+// Drop the inode's cached times without writing them, when it's freed.
+void times_forget(int inum);
+// Write all cached times to the table and empty the cache, on unmount.
+void times_close();
+
+#endif
@@ -0,0 +1,130 @@
+// Implementation of trace.h
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set once by trace_init and cleared by trace_close while other threads
+// may be tracing, so it's only read atomically or under trace_lock.
+static FILE *trace_file = NULL;
+static uint64_t trace_epoch = 0; // monotonic time the trace started, in us
+
+static const char *op_names[TRACE_OPS] = {
+    "?", "access", "getattr", "readdir", "mknod", "mkdir", "link", "unlink",
+    "rmdir", "rename", "chmod", "truncate", "open", "read", "write", "flush",
+    "fsync", "statfs", "utimens", "clone", "copy_range", "set_compression",
+    "get_compression", "set_dedup", "get_dedup", "fallocate",
+};
+
+// Gets the monotonic time in microseconds.
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start tracing to the file named by NUFS_TRACE, if it's set.
+void trace_init() {
+    const char *path = getenv("NUFS_TRACE");
+    if (path == NULL || *path == 0) {
+        return;
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return;
+    }
+
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.started = time(NULL);
+    fwrite(&hdr, sizeof(hdr), 1, file);
+    trace_epoch = now_us();
+    __atomic_store_n(&trace_file, file, __ATOMIC_SEQ_CST);
+    printf("+ trace_init() -> %s\n", path);
+}
+
+// Finish the trace.
+void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fclose(trace_file);
+        __atomic_store_n(&trace_file, NULL, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Note the time an operation starts. Free when not tracing.
+uint64_t trace_start() {
+    return __atomic_load_n(&trace_file, __ATOMIC_SEQ_CST) ? now_us() : 0;
+}
+
+// Record a finished operation.
+void trace_op(int op, const char *path, const char *path2, uint64_t size,
+              int64_t offset, int64_t arg, uint64_t start, int result) {
+    if (__atomic_load_n(&trace_file, __ATOMIC_SEQ_CST) == NULL) {
+        return;
+    }
+    trace_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.start_us = start - trace_epoch;
+    rec.latency_us = now_us() - start;
+    rec.offset = offset;
+    rec.arg = arg;
+    rec.size = size;
+    rec.result = result;
+    rec.path_len = strlen(path);
+    rec.path2_len = path2 ? strlen(path2) : 0;
+    rec.op = op;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        fwrite(path, 1, rec.path_len, trace_file);
+        if (path2) {
+            fwrite(path2, 1, rec.path2_len, trace_file);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Name of the operation.
+const char *trace_op_name(int op) {
+    return op > 0 && op < TRACE_OPS ? op_names[op] : op_names[0];
+}
+
+// Read the header of a trace.
+int trace_read_header(FILE *file, trace_header_t *hdr) {
+    if (fread(hdr, sizeof(*hdr), 1, file) != 1 || hdr->magic != TRACE_MAGIC ||
+        hdr->version != TRACE_VERSION) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads len bytes of a path and terminates it.
+static int read_path(FILE *file, char *path, int len, int path_max) {
+    if (len >= path_max || fread(path, 1, len, file) != (size_t) len) {
+        return -1;
+    }
+    path[len] = 0;
+    return 0;
+}
+
+// Read the next record and its paths.
+int trace_read(FILE *file, trace_record_t *rec, char *path, char *path2, int path_max) {
+    if (fread(rec, sizeof(*rec), 1, file) != 1) {
+        return feof(file) ? 0 : -1;
+    }
+    if (read_path(file, path, rec->path_len, path_max) < 0 ||
+        read_path(file, path2, rec->path2_len, path_max) < 0) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,87 @@
+// Capture of the FUSE operations hitting nufs.c, for replaying them later
+// with nufs_replay.
+//
+// Setting NUFS_TRACE to a file name when mounting records every callback
+// to that file as a compact binary trace: a trace_header_t followed by one
+// trace_record_t per operation, in the order they finished, each followed
+// by the path(s) it was called with. File contents are never recorded, so
+// a trace of a real workload can be shared without its data.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC 0x5254554e // "NUTR"
+#define TRACE_VERSION 1
+
+// Operations in a trace
+#define TRACE_ACCESS 1
+#define TRACE_GETATTR 2
+#define TRACE_READDIR 3
+#define TRACE_MKNOD 4
+#define TRACE_MKDIR 5
+#define TRACE_LINK 6 // path is the new link, path2 the existing file
+#define TRACE_UNLINK 7
+#define TRACE_RMDIR 8
+#define TRACE_RENAME 9 // from path to path2
+#define TRACE_CHMOD 10
+#define TRACE_TRUNCATE 11
+#define TRACE_OPEN 12
+#define TRACE_READ 13
+#define TRACE_WRITE 14
+#define TRACE_FLUSH 15
+#define TRACE_FSYNC 16
+#define TRACE_STATFS 17
+#define TRACE_UTIMENS 18
+#define TRACE_CLONE 19 // path2 is the source
+#define TRACE_COPY_RANGE 20 // path2 is the source, arg its offset
+#define TRACE_SET_COMPRESSION 21 // path2 is the codec
+#define TRACE_GET_COMPRESSION 22
+#define TRACE_SET_DEDUP 23
+#define TRACE_GET_DEDUP 24
+#define TRACE_FALLOCATE 25 // arg is the mode
+#define TRACE_OPS 26
+
+// The start of a trace file
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t started; // wall clock time the trace started, in seconds
+} trace_header_t;
+
+// One operation. The paths follow it, without terminating NULs.
+typedef struct trace_record {
+    uint64_t start_us; // since the trace started
+    int64_t offset;
+    int64_t arg; // mode, datasync flag, source offset or dedup setting
+    uint32_t size;
+    uint32_t latency_us;
+    int32_t result;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint8_t op;
+    uint8_t reserved[7];
+} trace_record_t;
+
+// Start tracing to the file named by NUFS_TRACE, if it's set.
+void trace_init();
+// Finish the trace.
+void trace_close();
+// Note the time an operation starts, to pass to trace_op.
+uint64_t trace_start();
+// Record a finished operation. path2 may be NULL.
+void trace_op(int op, const char *path, const char *path2, uint64_t size,
+              int64_t offset, int64_t arg, uint64_t start, int result);
+
+// Name of the operation, for reports.
+const char *trace_op_name(int op);
+// Read the header of a trace. Returns -1 if it isn't one.
+int trace_read_header(FILE *file, trace_header_t *hdr);
+// Read the next record and its paths, which are NUL terminated and must fit
+// in path_max bytes each. Returns 1 if there was one, 0 at the end of the
+// trace, -1 on errors.
+int trace_read(FILE *file, trace_record_t *rec, char *path, char *path2, int path_max);
+
+#endif